@@ -0,0 +1,32 @@
+#!/bin/bash
+
+# Runs every workload under every policy at several frame counts and
+# prints one CSV row per run.  PAGES, FRAMES, POLICIES and WORKLOADS
+# may be set in the environment to change the sweep.
+
+pages=${PAGES:-100}
+frames=${FRAMES:-"40 60 80 95"}
+policies=${POLICIES:-"fifo rand custom"}
+workloads=${WORKLOADS:-"sort scan focus zipf zipf:0.5 stride matmul matmul-blocked chase hash loop"}
+
+virtmem=$(cd "$(dirname "$0")" && pwd)/virtmem
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+cd "$scratch"
+
+echo "Workload,Policy,Frames,Pages,Faults,Reads,Writes,IOs,WallTime,FaultsPerSec"
+
+for workload in $workloads
+do
+    for policy in $policies
+    do
+        for nframes in $frames
+        do
+            "$virtmem" $pages $nframes $policy $workload | awk -v w=$workload -v p=$policy '
+                /^Frames:/ {
+                    gsub(/[A-Za-z]+: /, ""); split($0, f, ", ")
+                    printf "%s,%s,%d,%d,%d,%d,%d,%d,%.6f,%.0f\n", w, p, f[1], f[2], f[3], f[4], f[5], f[4]+f[5], f[7], (f[7] > 0 ? f[3]/f[7] : 0)
+                }'
+        done
+    done
+done
@@ -0,0 +1,154 @@
+#include "device_model.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+/*
+Each kind of device supplies the time to serve one access once it has
+reached the head of a queue, and how many accesses it can serve at once.
+All times are in seconds.
+*/
+
+struct device_kind {
+	const char *name;
+	int queue_depth;
+	double (*service)( struct device_model *m, long block, int write );
+};
+
+struct device_model {
+	const struct device_kind *kind;
+	pthread_mutex_t lock;
+	int block_size;
+	long last_block;
+	double now;
+	double *busy_until;
+};
+
+/*
+A 7200 rpm disk.  An access that continues where the previous one
+stopped streams straight off the platter.  Anything else pays a seek,
+which grows with the square root of the number of tracks crossed, and
+on average half a rotation before the block passes under the head.
+*/
+
+#define HDD_TRACK_BYTES   (1024*1024)
+#define HDD_SETTLE        0.0008
+#define HDD_SEEK_PER_TRACK 0.00008
+#define HDD_HALF_ROTATION (60.0/7200/2)
+#define HDD_BANDWIDTH     150e6
+
+static double hdd_service( struct device_model *m, long block, int write )
+{
+	double t = (double)m->block_size/HDD_BANDWIDTH;
+
+	if(block!=m->last_block+1) {
+		long tracks = labs((long)block-m->last_block)*m->block_size/HDD_TRACK_BYTES;
+		if(tracks>0) t += HDD_SETTLE + HDD_SEEK_PER_TRACK*sqrt((double)tracks);
+		t += HDD_HALF_ROTATION;
+	}
+
+	return t;
+}
+
+/*
+A NAND flash SSD.  Position does not matter, but programming a page
+takes several times longer than reading one, and the drive works on
+many commands at once.
+*/
+
+#define SSD_READ_LATENCY  0.00008
+#define SSD_WRITE_LATENCY 0.00025
+#define SSD_BANDWIDTH     2e9
+
+static double ssd_service( struct device_model *m, long block, int write )
+{
+	return (write ? SSD_WRITE_LATENCY : SSD_READ_LATENCY) + (double)m->block_size/SSD_BANDWIDTH;
+}
+
+static const struct device_kind device_kinds[] = {
+	{ "hdd", 1,  hdd_service },
+	{ "ssd", 32, ssd_service },
+};
+
+struct device_model * device_model_create( const char *name, int block_size )
+{
+	struct device_model *m;
+	const struct device_kind *kind = 0;
+	int i;
+
+	for(i=0;i<sizeof(device_kinds)/sizeof(device_kinds[0]);i++) {
+		if(!strcmp(name,device_kinds[i].name)) kind = &device_kinds[i];
+	}
+	if(!kind) return 0;
+
+	m = malloc(sizeof(*m));
+	if(!m) return 0;
+
+	m->busy_until = calloc(kind->queue_depth,sizeof(double));
+	if(!m->busy_until) {
+		free(m);
+		return 0;
+	}
+
+	m->kind = kind;
+	m->block_size = block_size;
+	m->last_block = -1;
+	m->now = 0;
+
+	pthread_mutex_init(&m->lock,0);
+
+	return m;
+}
+
+void device_model_access( struct device_model *m, long block, int write )
+{
+	int i, slot = 0;
+	double start;
+
+	pthread_mutex_lock(&m->lock);
+
+	/* The access goes to whichever queue slot frees up first. */
+
+	for(i=1;i<m->kind->queue_depth;i++) {
+		if(m->busy_until[i]<m->busy_until[slot]) slot = i;
+	}
+
+	start = m->busy_until[slot]>m->now ? m->busy_until[slot] : m->now;
+	m->busy_until[slot] = start + m->kind->service(m,block,write);
+	m->last_block = block;
+
+	if(!write) m->now = m->busy_until[slot];
+
+	pthread_mutex_unlock(&m->lock);
+}
+
+double device_model_time( struct device_model *m )
+{
+	double t;
+	int i;
+
+	pthread_mutex_lock(&m->lock);
+
+	t = m->now;
+	for(i=0;i<m->kind->queue_depth;i++) {
+		if(m->busy_until[i]>t) t = m->busy_until[i];
+	}
+
+	pthread_mutex_unlock(&m->lock);
+
+	return t;
+}
+
+const char * device_model_name( struct device_model *m )
+{
+	return m->kind->name;
+}
+
+void device_model_delete( struct device_model *m )
+{
+	pthread_mutex_destroy(&m->lock);
+	free(m->busy_until);
+	free(m);
+}
@@ -0,0 +1,42 @@
+#ifndef DEVICE_MODEL_H
+#define DEVICE_MODEL_H
+
+/*
+A device model estimates how long a real storage device would take to
+serve the stream of block reads and writes made by the virtual disk.
+Nothing sleeps: every access only advances a modeled clock.
+
+Reads block the caller until they complete.  Writes are posted: they
+occupy the device but the caller does not wait for them, as with a
+write-back cache.  A device with a queue depth of one therefore still
+serializes a read behind any write issued before it.
+A model may be charged from several threads at once.
+*/
+
+struct device_model;
+
+/*
+Create a model of the device called "name", which is "hdd" or "ssd",
+serving blocks of "block_size" bytes.
+Returns null if the name is not known.
+*/
+
+struct device_model * device_model_create( const char *name, int block_size );
+
+/* Account for one access to "block".  "write" is nonzero for a write. */
+
+void device_model_access( struct device_model *m, long block, int write );
+
+/* Return the modeled time in seconds until every access so far has completed. */
+
+double device_model_time( struct device_model *m );
+
+/* Return the name the model was created with. */
+
+const char * device_model_name( struct device_model *m );
+
+/* Delete a device model. */
+
+void device_model_delete( struct device_model *m );
+
+#endif
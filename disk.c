@@ -3,7 +3,10 @@ Do not modify this file.
 Make all of your changes to main.c instead.
 */
 
+#define _GNU_SOURCE
+
 #include "disk.h"
+#include "device_model.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -11,34 +14,544 @@ Make all of your changes to main.c instead.
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 extern ssize_t pread (int __fd, void *__buf, size_t __nbytes, __off_t __offset);
 extern ssize_t pwrite (int __fd, const void *__buf, size_t __nbytes, __off_t __offset);
 
+/*
+A backend moves whole blocks between the backing file and memory.
+disk_read and disk_write check their arguments before calling it.
+*/
+
+struct disk_backend {
+	int  (*open)( struct disk *d );
+	void (*read)( struct disk *d, long block, char *data );
+	void (*write)( struct disk *d, long block, const char *data );
+	void (*readv)( struct disk *d, long block, int count, char **data );
+	void (*close)( struct disk *d );
+};
 
 struct disk {
 	int fd;
 	int block_size;
-	int nblocks;
+	long nblocks;
+	int flags;
+	char *map;
+	const struct disk_backend *backend;
+	struct device_model *model;
+	int nstripes;
+	int stripe_blocks;
+	struct disk_stripe *stripes;
+};
+
+/* The pread backend: one system call per block. */
+
+static int pread_open( struct disk *d )
+{
+	return 0;
+}
+
+static void pread_write( struct disk *d, long block, const char *data )
+{
+	int actual = pwrite(d->fd,data,d->block_size,(off_t)block*d->block_size);
+	if(actual!=d->block_size) {
+		fprintf(stderr,"disk_write: failed to write block #%ld: %s\n",block,strerror(errno));
+		abort();
+	}
+
+	if((d->flags&DISK_FDATASYNC) && fdatasync(d->fd)<0) {
+		fprintf(stderr,"disk_write: failed to sync block #%ld: %s\n",block,strerror(errno));
+		abort();
+	}
+}
+
+static void pread_read( struct disk *d, long block, char *data )
+{
+	int actual = pread(d->fd,data,d->block_size,(off_t)block*d->block_size);
+	if(actual!=d->block_size) {
+		fprintf(stderr,"disk_read: failed to read block #%ld: %s\n",block,strerror(errno));
+		abort();
+	}
+}
+
+/* Runs of blocks are read with one preadv per IOV_MAX blocks. */
+
+static void pread_readv( struct disk *d, long block, int count, char **data )
+{
+	struct iovec iov[IOV_MAX];
+	int i, n;
+
+	while(count>0) {
+		n = count<IOV_MAX ? count : IOV_MAX;
+
+		for(i=0;i<n;i++) {
+			iov[i].iov_base = data[i];
+			iov[i].iov_len = d->block_size;
+		}
+
+		ssize_t actual = preadv(d->fd,iov,n,(off_t)block*d->block_size);
+		if(actual!=(ssize_t)n*d->block_size) {
+			fprintf(stderr,"disk_readv: failed to read blocks #%ld-#%ld: %s\n",block,block+n-1,strerror(errno));
+			abort();
+		}
+
+		block += n;
+		data += n;
+		count -= n;
+	}
+}
+
+static void pread_close( struct disk *d )
+{
+}
+
+static const struct disk_backend pread_backend = {
+	pread_open, pread_read, pread_write, pread_readv, pread_close
+};
+
+/*
+The mmap backend: the whole backing file is mapped once, and blocks
+are copied without entering the kernel.  An evicted page is not going
+to be touched again soon, so writes use non-temporal stores and leave
+the cache to the pages that are still resident.
+*/
+
+static int mmap_open( struct disk *d )
+{
+	d->map = mmap(0,(size_t)d->nblocks*d->block_size,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+	if(d->map==MAP_FAILED) {
+		d->map = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Only "dst", a block of the mapping, is known to be aligned; the caller's buffer need not be. */
+
+static void stream_copy( char *dst, const char *src, int length )
+{
+#ifdef __SSE2__
+	__m128i *d = (__m128i*)dst;
+	const __m128i *s = (const __m128i*)src;
+	int i;
+
+	for(i=0;i<length/16;i+=4) {
+		__m128i a = _mm_loadu_si128(s+i);
+		__m128i b = _mm_loadu_si128(s+i+1);
+		__m128i c = _mm_loadu_si128(s+i+2);
+		__m128i e = _mm_loadu_si128(s+i+3);
+		_mm_stream_si128(d+i,a);
+		_mm_stream_si128(d+i+1,b);
+		_mm_stream_si128(d+i+2,c);
+		_mm_stream_si128(d+i+3,e);
+	}
+	_mm_sfence();
+#else
+	memcpy(dst,src,length);
+#endif
+}
+
+static void mmap_write( struct disk *d, long block, const char *data )
+{
+	char *target = d->map+(size_t)block*d->block_size;
+
+	stream_copy(target,data,d->block_size);
+
+	if((d->flags&DISK_FDATASYNC) && msync(target,d->block_size,MS_SYNC)<0) {
+		fprintf(stderr,"disk_write: failed to sync block #%ld: %s\n",block,strerror(errno));
+		abort();
+	}
+}
+
+static void mmap_read( struct disk *d, long block, char *data )
+{
+	memcpy(data,d->map+(size_t)block*d->block_size,d->block_size);
+}
+
+static void mmap_readv( struct disk *d, long block, int count, char **data )
+{
+	int i;
+
+	for(i=0;i<count;i++) mmap_read(d,block+i,data[i]);
+}
+
+static void mmap_close( struct disk *d )
+{
+	munmap(d->map,(size_t)d->nblocks*d->block_size);
+}
+
+static const struct disk_backend mmap_backend = {
+	mmap_open, mmap_read, mmap_write, mmap_readv, mmap_close
+};
+
+/*
+The stripe backend spreads the disk over several files, "stripe_blocks"
+consecutive blocks to a file in turn, so that they can sit on different
+devices.  Each file has its own worker thread serving a FIFO queue.
+Writes are copied to a bounce buffer and queued without waiting, so an
+eviction write can proceed on one device while the following read runs
+on another.  A read waits for its own completion only.  Every access to
+a block goes to the same queue, so a read is never served before a
+write of the same block that was queued ahead of it.
+
+Disk I/O runs inside the fault handler, where malloc is not safe, so
+each stripe allocates its write requests and their bounce buffers once
+when it opens and recycles them, and disk_readv queues reads in
+batches of at most STRIPE_MAX_READS from an array on the stack.
+*/
+
+#define STRIPE_MAX_WRITES 64
+#define STRIPE_MAX_READS  64
+
+struct stripe_request {
+	int write;
+	long block;
+	off_t offset;
+	char *data;
+	int done;
+	struct stripe_request *next;
 };
 
-struct disk * disk_open( const char *diskname, int nblocks )
+struct disk_stripe {
+	struct disk *disk;
+	int fd;
+	int started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t done;
+	struct stripe_request *head, *tail;
+	struct stripe_request *writes;
+	struct stripe_request *free_writes;
+	char *bounce;
+	int pending_writes;
+	int stop;
+	struct disk_stripe_stats stats;
+};
+
+static struct disk_stripe * stripe_of( struct disk *d, long block, off_t *offset )
+{
+	long unit = block/d->stripe_blocks;
+	long row = unit/d->nstripes;
+
+	*offset = ((off_t)row*d->stripe_blocks + block%d->stripe_blocks)*d->block_size;
+
+	return &d->stripes[unit%d->nstripes];
+}
+
+static double elapsed( struct timespec *start, struct timespec *stop )
+{
+	return (stop->tv_sec-start->tv_sec) + (stop->tv_nsec-start->tv_nsec)/1e9;
+}
+
+static void * stripe_worker( void *arg )
+{
+	struct disk_stripe *s = arg;
+	struct disk *d = s->disk;
+	struct stripe_request *r;
+	struct timespec start, stop;
+	sigset_t all;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK,&all,0);
+
+	pthread_mutex_lock(&s->lock);
+
+	while(1) {
+		while(!s->head && !s->stop) pthread_cond_wait(&s->ready,&s->lock);
+		if(!s->head) break;
+
+		r = s->head;
+		s->head = r->next;
+		if(!s->head) s->tail = 0;
+
+		pthread_mutex_unlock(&s->lock);
+
+		clock_gettime(CLOCK_MONOTONIC,&start);
+
+		if(r->write) {
+			if(pwrite(s->fd,r->data,d->block_size,r->offset)!=d->block_size) {
+				fprintf(stderr,"disk_write: failed to write block #%ld: %s\n",r->block,strerror(errno));
+				abort();
+			}
+			if((d->flags&DISK_FDATASYNC) && fdatasync(s->fd)<0) {
+				fprintf(stderr,"disk_write: failed to sync block #%ld: %s\n",r->block,strerror(errno));
+				abort();
+			}
+		} else {
+			if(pread(s->fd,r->data,d->block_size,r->offset)!=d->block_size) {
+				fprintf(stderr,"disk_read: failed to read block #%ld: %s\n",r->block,strerror(errno));
+				abort();
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC,&stop);
+
+		pthread_mutex_lock(&s->lock);
+
+		s->stats.busy += elapsed(&start,&stop);
+
+		if(r->write) {
+			s->stats.writes++;
+			s->pending_writes--;
+			r->next = s->free_writes;
+			s->free_writes = r;
+		} else {
+			s->stats.reads++;
+			r->done = 1;
+		}
+
+		pthread_cond_broadcast(&s->done);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+static void stripe_submit( struct disk_stripe *s, struct stripe_request *r )
+{
+	r->next = 0;
+	if(s->tail) {
+		s->tail->next = r;
+	} else {
+		s->head = r;
+	}
+	s->tail = r;
+	pthread_cond_signal(&s->ready);
+}
+
+static int stripe_open( struct disk *d )
+{
+	int i, j;
+
+	for(i=0;i<d->nstripes;i++) {
+		struct disk_stripe *s = &d->stripes[i];
+
+		s->head = s->tail = 0;
+		s->pending_writes = 0;
+		s->stop = 0;
+		s->disk = d;
+
+		s->writes = malloc(sizeof(struct stripe_request)*STRIPE_MAX_WRITES);
+		if(!s->writes || posix_memalign((void**)&s->bounce,d->block_size,(size_t)d->block_size*STRIPE_MAX_WRITES)) {
+			s->bounce = 0;
+			errno = ENOMEM;
+			return -1;
+		}
+
+		s->free_writes = 0;
+		for(j=0;j<STRIPE_MAX_WRITES;j++) {
+			s->writes[j].data = s->bounce + (size_t)j*d->block_size;
+			s->writes[j].next = s->free_writes;
+			s->free_writes = &s->writes[j];
+		}
+
+		pthread_mutex_init(&s->lock,0);
+		pthread_cond_init(&s->ready,0);
+		pthread_cond_init(&s->done,0);
+
+		if(pthread_create(&s->thread,0,stripe_worker,s)) {
+			errno = EAGAIN;
+			return -1;
+		}
+		s->started = 1;
+	}
+
+	return 0;
+}
+
+static void stripe_write( struct disk *d, long block, const char *data )
+{
+	struct stripe_request *r;
+	struct disk_stripe *s;
+	off_t offset;
+
+	s = stripe_of(d,block,&offset);
+
+	/* Wait for a free bounce buffer, then fill it outside the lock. */
+
+	pthread_mutex_lock(&s->lock);
+	while(!s->free_writes) pthread_cond_wait(&s->done,&s->lock);
+	r = s->free_writes;
+	s->free_writes = r->next;
+	s->pending_writes++;
+	pthread_mutex_unlock(&s->lock);
+
+	memcpy(r->data,data,d->block_size);
+	r->write = 1;
+	r->block = block;
+	r->offset = offset;
+
+	pthread_mutex_lock(&s->lock);
+	stripe_submit(s,r);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void stripe_read( struct disk *d, long block, char *data )
+{
+	struct stripe_request r;
+	struct disk_stripe *s;
+
+	s = stripe_of(d,block,&r.offset);
+
+	r.write = 0;
+	r.block = block;
+	r.data = data;
+	r.done = 0;
+
+	pthread_mutex_lock(&s->lock);
+	stripe_submit(s,&r);
+	while(!r.done) pthread_cond_wait(&s->done,&s->lock);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Queue every block of a batch before waiting, so the stripes read in parallel. */
+
+static void stripe_readv( struct disk *d, long block, int count, char **data )
+{
+	struct stripe_request r[STRIPE_MAX_READS];
+	struct disk_stripe *s;
+	int i;
+
+	while(count>STRIPE_MAX_READS) {
+		stripe_readv(d,block,STRIPE_MAX_READS,data);
+		block += STRIPE_MAX_READS;
+		data += STRIPE_MAX_READS;
+		count -= STRIPE_MAX_READS;
+	}
+
+	for(i=0;i<count;i++) {
+		s = stripe_of(d,block+i,&r[i].offset);
+
+		r[i].write = 0;
+		r[i].block = block+i;
+		r[i].data = data[i];
+		r[i].done = 0;
+
+		pthread_mutex_lock(&s->lock);
+		stripe_submit(s,&r[i]);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	for(i=0;i<count;i++) {
+		s = stripe_of(d,block+i,&r[i].offset);
+
+		pthread_mutex_lock(&s->lock);
+		while(!r[i].done) pthread_cond_wait(&s->done,&s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+static void stripe_close( struct disk *d )
+{
+	int i;
+
+	for(i=0;i<d->nstripes;i++) {
+		struct disk_stripe *s = &d->stripes[i];
+
+		/* The worker drains its queue before it stops. */
+
+		if(s->started) {
+			pthread_mutex_lock(&s->lock);
+			s->stop = 1;
+			pthread_cond_signal(&s->ready);
+			pthread_mutex_unlock(&s->lock);
+
+			pthread_join(s->thread,0);
+
+			pthread_mutex_destroy(&s->lock);
+			pthread_cond_destroy(&s->ready);
+			pthread_cond_destroy(&s->done);
+		}
+
+		free(s->writes);
+		free(s->bounce);
+	}
+}
+
+static const struct disk_backend stripe_backend = {
+	stripe_open, stripe_read, stripe_write, stripe_readv, stripe_close
+};
+
+/*
+Building with DISK_BACKEND set to pread, mmap or stripe fixes the
+backend at compile time.  Blocks then move through direct calls that
+can inline, and opening a disk that needs another backend fails with
+EINVAL.
+*/
+
+#ifdef DISK_BACKEND
+#define BACKEND_OF(name) BACKEND_OF_(name)
+#define BACKEND_OF_(name) (&name##_backend)
+#define FIXED_BACKEND BACKEND_OF(DISK_BACKEND)
+#define BACKEND(d) FIXED_BACKEND
+#else
+#define BACKEND(d) ((d)->backend)
+#endif
+
+struct disk * disk_open( const char *diskname, long nblocks )
+{
+	return disk_open_flags(diskname,nblocks,0);
+}
+
+struct disk * disk_open_flags( const char *diskname, long nblocks, int flags )
+{
+	return disk_open_sized(diskname,nblocks,BLOCK_SIZE,flags);
+}
+
+struct disk * disk_open_sized( const char *diskname, long nblocks, int block_size, int flags )
 {
 	struct disk *d;
+	const struct disk_backend *backend = (flags&DISK_MMAP) ? &mmap_backend : &pread_backend;
+	int oflags = O_CREAT|O_RDWR;
+
+	if(block_size<BLOCK_SIZE || block_size%BLOCK_SIZE || ((flags&DISK_MMAP) && (flags&(DISK_DIRECT|DISK_DSYNC)))) {
+		errno = EINVAL;
+		return 0;
+	}
+
+#ifdef FIXED_BACKEND
+	if(backend!=FIXED_BACKEND) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+
+	if(flags&DISK_DIRECT) oflags |= O_DIRECT;
+	if(flags&DISK_DSYNC) oflags |= O_DSYNC;
 
 	d = malloc(sizeof(*d));
 	if(!d) return 0;
 
-	d->fd = open(diskname,O_CREAT|O_RDWR,0777);
+	d->fd = open(diskname,oflags,0777);
 	if(d->fd<0) {
 		free(d);
 		return 0;
 	}
 
-	d->block_size = BLOCK_SIZE;
+	d->block_size = block_size;
 	d->nblocks = nblocks;
+	d->flags = flags;
+	d->map = 0;
+	d->model = 0;
+	d->nstripes = 0;
+	d->stripe_blocks = 0;
+	d->stripes = 0;
+	d->backend = backend;
 
-	if(ftruncate(d->fd,d->nblocks*d->block_size)<0) {
+	if(ftruncate(d->fd,(off_t)d->nblocks*d->block_size)<0 || BACKEND(d)->open(d)<0) {
 		close(d->fd);
 		free(d);
 		return 0;
@@ -47,41 +560,190 @@ struct disk * disk_open( const char *diskname, int nblocks )
 	return d;
 }
 
-void disk_write( struct disk *d, int block, const char *data )
+struct disk * disk_open_striped( const char **disknames, int nstripes, int stripe_blocks, long nblocks, int block_size, int flags )
 {
+	struct disk *d;
+	int oflags = O_CREAT|O_RDWR;
+	int i;
+	long units, rows;
+
+	if(nstripes<1 || stripe_blocks<1 || block_size<BLOCK_SIZE || block_size%BLOCK_SIZE || (flags&DISK_MMAP)) {
+		errno = EINVAL;
+		return 0;
+	}
+
+#ifdef FIXED_BACKEND
+	if(&stripe_backend!=FIXED_BACKEND) {
+		errno = EINVAL;
+		return 0;
+	}
+#endif
+
+	if(flags&DISK_DIRECT) oflags |= O_DIRECT;
+	if(flags&DISK_DSYNC) oflags |= O_DSYNC;
+
+	d = malloc(sizeof(*d));
+	if(!d) return 0;
+
+	d->stripes = calloc(nstripes,sizeof(struct disk_stripe));
+	if(!d->stripes) {
+		free(d);
+		return 0;
+	}
+
+	d->fd = -1;
+	d->block_size = block_size;
+	d->nblocks = nblocks;
+	d->flags = flags;
+	d->map = 0;
+	d->model = 0;
+	d->nstripes = nstripes;
+	d->stripe_blocks = stripe_blocks;
+	d->backend = &stripe_backend;
+
+	/* Every file holds the same number of stripe units. */
+
+	units = (nblocks+stripe_blocks-1)/stripe_blocks;
+	rows = (units+nstripes-1)/nstripes;
+
+	for(i=0;i<nstripes;i++) {
+		d->stripes[i].fd = open(disknames[i],oflags,0777);
+		if(d->stripes[i].fd<0 || ftruncate(d->stripes[i].fd,(off_t)rows*stripe_blocks*d->block_size)<0) {
+			while(i>=0) {
+				if(d->stripes[i].fd>=0) close(d->stripes[i].fd);
+				i--;
+			}
+			free(d->stripes);
+			free(d);
+			return 0;
+		}
+	}
+
+	if(BACKEND(d)->open(d)<0) {
+		disk_close(d);
+		return 0;
+	}
+
+	return d;
+}
+
+void disk_write( struct disk *d, long block, const char *data )
+{
+#ifndef NDEBUG
 	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_write: invalid block #%d\n",block);
+		fprintf(stderr,"disk_write: invalid block #%ld\n",block);
 		abort();
 	}
+#endif
 
-	int actual = pwrite(d->fd,data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_write: failed to write block #%d: %s\n",block,strerror(errno));
+	if((d->flags&DISK_DIRECT) && ((uintptr_t)data%BLOCK_SIZE)) {
+		fprintf(stderr,"disk_write: buffer %p is not aligned for O_DIRECT\n",data);
 		abort();
 	}
+
+	if(d->model) device_model_access(d->model,block,1);
+
+	BACKEND(d)->write(d,block,data);
 }
 
-void disk_read( struct disk *d, int block, char *data )
+void disk_read( struct disk *d, long block, char *data )
 {
+#ifndef NDEBUG
 	if(block<0 || block>=d->nblocks) {
-		fprintf(stderr,"disk_read: invalid block #%d\n",block);
+		fprintf(stderr,"disk_read: invalid block #%ld\n",block);
 		abort();
 	}
+#endif
 
-	int actual = pread(d->fd,data,d->block_size,block*d->block_size);
-	if(actual!=d->block_size) {
-		fprintf(stderr,"disk_read: failed to read block #%d: %s\n",block,strerror(errno));
+	if((d->flags&DISK_DIRECT) && ((uintptr_t)data%BLOCK_SIZE)) {
+		fprintf(stderr,"disk_read: buffer %p is not aligned for O_DIRECT\n",data);
 		abort();
 	}
+
+	if(d->model) device_model_access(d->model,block,0);
+
+	BACKEND(d)->read(d,block,data);
 }
 
-int disk_nblocks( struct disk *d )
+void disk_readv( struct disk *d, long block, int count, char **data )
+{
+	int i;
+
+#ifndef NDEBUG
+	if(count<0 || block<0 || block+count>d->nblocks) {
+		fprintf(stderr,"disk_readv: invalid blocks #%ld-#%ld\n",block,block+count-1);
+		abort();
+	}
+#endif
+
+	for(i=0;i<count;i++) {
+		if((d->flags&DISK_DIRECT) && ((uintptr_t)data[i]%BLOCK_SIZE)) {
+			fprintf(stderr,"disk_readv: buffer %p is not aligned for O_DIRECT\n",data[i]);
+			abort();
+		}
+
+		if(d->model) device_model_access(d->model,block+i,0);
+	}
+
+	BACKEND(d)->readv(d,block,count,data);
+}
+
+void disk_set_model( struct disk *d, struct device_model *m )
+{
+	d->model = m;
+}
+
+void disk_sync( struct disk *d )
+{
+	int i;
+
+	for(i=0;i<d->nstripes;i++) {
+		struct disk_stripe *s = &d->stripes[i];
+
+		pthread_mutex_lock(&s->lock);
+		while(s->pending_writes>0) pthread_cond_wait(&s->done,&s->lock);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+int disk_nstripes( struct disk *d )
+{
+	return d->nstripes;
+}
+
+void disk_get_stripe_stats( struct disk *d, int stripe, struct disk_stripe_stats *stats )
+{
+	struct disk_stripe *s;
+
+	if(stripe<0 || stripe>=d->nstripes) {
+		fprintf(stderr,"disk_get_stripe_stats: invalid stripe #%d\n",stripe);
+		abort();
+	}
+
+	s = &d->stripes[stripe];
+
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int disk_block_size( struct disk *d )
+{
+	return d->block_size;
+}
+
+long disk_nblocks( struct disk *d )
 {
 	return d->nblocks;
 }
 
 void disk_close( struct disk *d )
 {
-	close(d->fd);
+	int i;
+
+	BACKEND(d)->close(d);
+	if(d->fd>=0) close(d->fd);
+	for(i=0;i<d->nstripes;i++) close(d->stripes[i].fd);
+	free(d->stripes);
 	free(d);
 }
@@ -7,36 +7,135 @@ Make all of your changes to main.c instead.
 #ifndef DISK_H
 #define DISK_H
 
+/*
+BLOCK_SIZE is the block size of disks opened with disk_open or
+disk_open_flags, and the alignment O_DIRECT buffers need whatever the
+block size.
+*/
+
 #define BLOCK_SIZE 4096
 
+struct device_model;
+
+/*
+Flags for disk_open_flags.
+DISK_DIRECT opens the backing file with O_DIRECT, so reads and writes
+bypass the host page cache.  Every buffer passed to disk_read and
+disk_write must then be aligned to BLOCK_SIZE; physical memory frames
+come from mmap and always are.
+DISK_DSYNC opens the backing file with O_DSYNC, so each write returns
+only once its data is on stable storage.
+DISK_FDATASYNC calls fdatasync after each write instead.
+DISK_MMAP maps the backing file and copies blocks to and from the
+mapping instead of issuing a system call per block.  It cannot be
+combined with DISK_DIRECT or DISK_DSYNC; with DISK_FDATASYNC each
+written block is flushed with msync.
+*/
+
+#define DISK_DIRECT    1
+#define DISK_DSYNC     2
+#define DISK_FDATASYNC 4
+#define DISK_MMAP      8
+
 /*
 Create a new virtual disk in the file "filename", with the given number of blocks.
 Returns a pointer to a new disk object, or null on failure.
 */
 
-struct disk * disk_open( const char *filename, int blocks );
+struct disk * disk_open( const char *filename, long blocks );
+
+/*
+Like disk_open, but "flags" may be any of DISK_DIRECT, DISK_DSYNC,
+DISK_FDATASYNC, or DISK_MMAP logical-ored together.
+Returns null on failure, for example when the file system holding
+"filename" does not support O_DIRECT.
+*/
+
+struct disk * disk_open_flags( const char *filename, long blocks, int flags );
+
+/*
+Like disk_open_flags, with blocks of "block_size" bytes, which must be
+a multiple of BLOCK_SIZE.
+*/
+
+struct disk * disk_open_sized( const char *filename, long blocks, int block_size, int flags );
+
+/*
+Create a new virtual disk of "blocks" blocks striped across the
+"nstripes" files named in "filenames", "stripe_blocks" consecutive
+blocks to a file in turn.  Blocks are "block_size" bytes, a multiple
+of BLOCK_SIZE.  "flags" is as for disk_open_flags, except
+that DISK_MMAP is not allowed.  Each file is served by its own I/O
+thread: disk_write copies the block and returns without waiting for it
+to reach the file, while disk_read waits for its data.  disk_close
+waits for all outstanding writes.
+Returns null on failure.
+*/
+
+struct disk * disk_open_striped( const char **filenames, int nstripes, int stripe_blocks, long blocks, int block_size, int flags );
 
 /*
-Write exactly BLOCK_SIZE bytes to a given block on the virtual disk.
+Write exactly one block to a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to the data to write.
 */
 
-void disk_write( struct disk *d, int block, const char *data );
+void disk_write( struct disk *d, long block, const char *data );
 
 /*
-Read exactly BLOCK_SIZE bytes from a given block on the virtual disk.
+Read exactly one block from a given block on the virtual disk.
 "d" must be a pointer to a virtual disk, "block" is the block number,
 and "data" is a pointer to where the data will be placed.
 */
 
-void disk_read( struct disk *d, int block, char *data );
+void disk_read( struct disk *d, long block, char *data );
+
+/*
+Read the "count" consecutive blocks starting at "block" with as few
+requests as possible, placing block+i at "data[i]".
+*/
+
+void disk_readv( struct disk *d, long block, int count, char **data );
+
+/*
+Charge every subsequent read and write to the device model "m",
+or stop charging them if "m" is null.  The disk does not own the model.
+*/
+
+void disk_set_model( struct disk *d, struct device_model *m );
+
+/* Wait until every write issued so far has reached the backing files. */
+
+void disk_sync( struct disk *d );
+
+/* Work done so far by the I/O thread of one stripe. */
+
+struct disk_stripe_stats {
+	long reads;
+	long writes;
+	double busy;
+};
+
+/* Return the number of stripes of a striped disk, or 0 for any other disk. */
+
+int disk_nstripes( struct disk *d );
+
+/*
+Fill in "stats" with the number of blocks read and written by stripe
+number "stripe", and the seconds its I/O thread spent doing so.
+*/
+
+void disk_get_stripe_stats( struct disk *d, int stripe, struct disk_stripe_stats *stats );
+
+/* Return the size in bytes of each block of the virtual disk. */
+
+int disk_block_size( struct disk *d );
 
 /*
 Return the number of blocks in the virtual disk.
 */
 
-int disk_nblocks( struct disk *d );
+long disk_nblocks( struct disk *d );
 
 /*
 Close the virtual disk.
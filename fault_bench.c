@@ -0,0 +1,305 @@
+
+/*
+Fault path microbenchmark.
+
+Drives the page_table and disk layers directly with synthetic touch
+patterns and reports the cost of one fault, or one call, in each case:
+
+  mprotect     mprotect alone on a mapped page, no fault
+  remap        remap_file_pages alone on a mapped page, no fault
+  entry        page_table_set_entry, which does both, no fault
+  upgrade      write to a page mapped read-only: signal delivery,
+               handler dispatch and page_table_set_entry
+  first-touch  write to an unmapped page with a free frame waiting
+  evict-null   every touch evicts a clean page, the frame is picked
+               by a null policy (page modulo frames) and there is no I/O
+  evict-fifo   the same with a FIFO hand and a frame owner table
+  evict-pread  evict-fifo, writing back the victim and reading the page
+               with the pread disk backend
+  evict-mmap   the same with the mmap disk backend
+
+Subtracting cases isolates a layer: upgrade minus entry is the cost
+of the signal, evict-fifo minus evict-null the cost of the policy, and
+evict-pread minus evict-fifo the cost of the I/O.  Every fault case
+runs against both the dense and the sparse page table.
+
+The process is pinned to one CPU, each case runs some warmup rounds
+that are thrown away, and then a number of timed rounds of which the
+median, minimum and relative standard deviation are reported.
+*/
+
+#define _GNU_SOURCE
+
+#include "page_table.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <math.h>
+
+// To avoid warning
+int remap_file_pages(void *addr, size_t size, int prot,
+                            size_t pgoff, int flags);
+
+#define BENCH_DISK "fault_bench_disk"
+
+enum { POLICY_NONE, POLICY_NULL, POLICY_FIFO };
+
+struct bench_case {
+	const char *name;
+	int faults;
+	int policy;
+	int disk_flags;
+	int use_disk;
+};
+
+static const struct bench_case bench_cases[] = {
+	{ "mprotect",    0, POLICY_NONE, 0,         0 },
+	{ "remap",       0, POLICY_NONE, 0,         0 },
+	{ "entry",       0, POLICY_NONE, 0,         0 },
+	{ "upgrade",     1, POLICY_NONE, 0,         0 },
+	{ "first-touch", 1, POLICY_NONE, 0,         0 },
+	{ "evict-null",  1, POLICY_NULL, 0,         0 },
+	{ "evict-fifo",  1, POLICY_FIFO, 0,         0 },
+	{ "evict-pread", 1, POLICY_FIFO, 0,         1 },
+	{ "evict-mmap",  1, POLICY_FIFO, DISK_MMAP, 1 },
+};
+
+#define NCASES (sizeof(bench_cases)/sizeof(bench_cases[0]))
+
+/* State shared with the fault handler, which cannot take arguments. */
+
+static const struct bench_case *current;
+static struct disk *disk;
+static int nframes;
+static int *frame_owner;
+static int hand;
+static long faults;
+
+static void bench_fault_handler( struct page_table *pt, int page )
+{
+	char *physmem = page_table_get_physmem(pt);
+	int frame, bits;
+
+	faults++;
+
+	page_table_get_entry(pt,page,&frame,&bits);
+
+	if(bits&PROT_READ) {
+		page_table_set_entry(pt,page,frame,PROT_READ|PROT_WRITE);
+		return;
+	}
+
+	if(current->policy==POLICY_NONE) {
+		page_table_set_entry(pt,page,page,PROT_READ|PROT_WRITE);
+		return;
+	}
+
+	if(current->policy==POLICY_NULL) {
+		frame = page%nframes;
+	} else {
+		frame = hand;
+		hand = (hand+1)%nframes;
+	}
+
+	if(frame_owner[frame]>=0) {
+		int victim = frame_owner[frame];
+		int vframe, vbits;
+
+		page_table_get_entry(pt,victim,&vframe,&vbits);
+		if(disk && (vbits&PROT_WRITE)) disk_write(disk,victim,&physmem[(size_t)frame*PAGE_SIZE]);
+		page_table_set_entry(pt,victim,0,0);
+	}
+
+	if(disk) disk_read(disk,page,&physmem[(size_t)frame*PAGE_SIZE]);
+
+	page_table_set_entry(pt,page,frame,PROT_READ|PROT_WRITE);
+	frame_owner[frame] = page;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/*
+Runs one round of a case and returns the nanoseconds spent per fault,
+or per call for the cases that do not fault.  Setting up the state the
+round starts from is not timed.
+*/
+
+static double run_round( struct page_table *pt, int npages )
+{
+	char *virtmem = page_table_get_virtmem(pt);
+	const char *name = current->name;
+	double start, elapsed;
+	long count;
+	int i;
+
+	if(!strcmp(name,"upgrade")) {
+		for(i=0;i<npages;i++) page_table_set_entry(pt,i,i,PROT_READ);
+	} else if(!strcmp(name,"first-touch")) {
+		for(i=0;i<npages;i++) page_table_set_entry(pt,i,0,0);
+	} else if(!current->faults) {
+		for(i=0;i<npages;i++) page_table_set_entry(pt,i,i,PROT_READ|PROT_WRITE);
+	}
+
+	faults = 0;
+	start = now();
+
+	if(!strcmp(name,"mprotect")) {
+		for(i=0;i<npages;i++) mprotect(virtmem+(size_t)i*PAGE_SIZE,PAGE_SIZE,PROT_READ|PROT_WRITE);
+		count = npages;
+	} else if(!strcmp(name,"remap")) {
+		for(i=0;i<npages;i++) remap_file_pages(virtmem+(size_t)i*PAGE_SIZE,PAGE_SIZE,0,i,0);
+		count = npages;
+	} else if(!strcmp(name,"entry")) {
+		for(i=0;i<npages;i++) page_table_set_entry(pt,i,i,PROT_READ|PROT_WRITE);
+		count = npages;
+	} else {
+		for(i=0;i<npages;i++) ((volatile char*)virtmem)[(size_t)i*PAGE_SIZE] = i;
+		count = faults;
+	}
+
+	elapsed = now()-start;
+
+	if(current->faults && faults!=npages) {
+		fprintf(stderr,"fault_bench: %s took %ld faults for %d pages\n",name,faults,npages);
+		exit(1);
+	}
+
+	return elapsed/count;
+}
+
+static int compare_doubles( const void *pa, const void *pb )
+{
+	double a = *(double*)pa;
+	double b = *(double*)pb;
+
+	return a<b ? -1 : a>b;
+}
+
+static void run_case( const struct bench_case *c, int sparse, int npages, int warmup, int rounds )
+{
+	struct frame_pool *pool;
+	struct page_table *pt;
+	double *samples = malloc(sizeof(double)*rounds);
+	double mean = 0, var = 0;
+	int i;
+
+	current = c;
+	nframes = c->policy==POLICY_NONE ? npages : npages/4;
+	hand = 0;
+	disk = 0;
+
+	frame_owner = malloc(sizeof(int)*nframes);
+	for(i=0;i<nframes;i++) frame_owner[i] = -1;
+
+	pool = frame_pool_create(nframes);
+	if(!pool) {
+		fprintf(stderr,"fault_bench: couldn't create frame pool\n");
+		exit(1);
+	}
+
+	pt = page_table_create_in_pool(pool,npages,bench_fault_handler,sparse ? PAGE_TABLE_SPARSE : 0);
+	if(!pt) {
+		fprintf(stderr,"fault_bench: couldn't create page table\n");
+		exit(1);
+	}
+
+	if(c->use_disk) {
+		disk = disk_open_flags(BENCH_DISK,npages,c->disk_flags);
+		if(!disk) {
+			fprintf(stderr,"fault_bench: couldn't open %s\n",BENCH_DISK);
+			exit(1);
+		}
+	}
+
+	for(i=0;i<warmup;i++) run_round(pt,npages);
+	for(i=0;i<rounds;i++) samples[i] = run_round(pt,npages);
+
+	for(i=0;i<rounds;i++) mean += samples[i];
+	mean /= rounds;
+	for(i=0;i<rounds;i++) var += (samples[i]-mean)*(samples[i]-mean);
+	var /= rounds>1 ? rounds-1 : 1;
+
+	qsort(samples,rounds,sizeof(double),compare_doubles);
+
+	printf("%s,%s,%d,%d,%.1f,%.1f,%.2f\n",
+		c->name, sparse ? "sparse" : "dense", npages, nframes,
+		samples[rounds/2], samples[0], 100*sqrt(var)/mean);
+	fflush(stdout);
+
+	if(disk) {
+		disk_close(disk);
+		unlink(BENCH_DISK);
+	}
+
+	page_table_delete(pt);
+	frame_pool_delete(pool);
+	free(frame_owner);
+	free(samples);
+}
+
+static void usage()
+{
+	int i;
+
+	printf("use: fault_bench [-n npages] [-w warmup] [-r rounds] [-c cpu] [case ...]\n");
+	printf("cases:");
+	for(i=0;i<NCASES;i++) printf(" %s",bench_cases[i].name);
+	printf("\n");
+}
+
+int main( int argc, char *argv[] )
+{
+	int npages = 4096;
+	int warmup = 3;
+	int rounds = 15;
+	int cpu = 0;
+	int opt, i, j;
+	cpu_set_t set;
+
+	while((opt=getopt(argc,argv,"n:w:r:c:h"))!=-1) {
+		switch(opt) {
+			case 'n': npages = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'r': rounds = atoi(optarg); break;
+			case 'c': cpu = atoi(optarg); break;
+			default: usage(); return 1;
+		}
+	}
+
+	if(npages<4 || rounds<1 || warmup<0) {
+		usage();
+		return 1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu,&set);
+	if(sched_setaffinity(0,sizeof(set),&set)) {
+		fprintf(stderr,"fault_bench: couldn't pin to cpu %d, running unpinned\n",cpu);
+	}
+
+	printf("Case,Table,Pages,Frames,MedianNs,MinNs,StdDevPct\n");
+
+	for(i=0;i<NCASES;i++) {
+		const struct bench_case *c = &bench_cases[i];
+
+		if(optind<argc) {
+			for(j=optind;j<argc;j++) if(!strcmp(argv[j],c->name)) break;
+			if(j==argc) continue;
+		}
+
+		run_case(c,0,npages,warmup,rounds);
+		if(c->faults) run_case(c,1,npages,warmup,rounds);
+	}
+
+	return 0;
+}
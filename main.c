@@ -5,8 +5,11 @@
  * Carlos Ferry
  * Jared Willard
  *
- * Three page fault handlders with three different
- * eviction policies.
+ * One page fault handler shared by every eviction policy.
+ * The handler may run on several threads at once, so a
+ * workload can fault in parallel.  It does all the page table
+ * and disk work, and only asks the policy, through the
+ * interface in policy.h, which frame to evict.
  *
  *  FIFO: evicts on a first-in-first-out policy.
  *
@@ -15,569 +18,1876 @@
  *  Custom: evicts pages on a random, second-chance basis, favoring
  *          pages that have the dirty bit set. We have named this
  *          algorithm: "Second-try-random", or "2ndrand".
+ *
+ * Further policies can be loaded from shared objects at run time.
  */
 
 #include "page_table.h"
 #include "disk.h"
 #include "program.h"
+#include "device_model.h"
+#include "policy.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <limits.h>
 
 /* Handy Bool Typedef */
 
 typedef enum { false, true } bool;  
 
 
-static int TotalPages = 0;
-static int TotalFrames = 0; 
-
 /* Pointers to data structures that the fault handlers need */
 
 char *physmem = NULL;
 
 struct disk *disk = NULL;
 
+/* Storage device whose service time is modeled, if any. */
+
+struct device_model *model = NULL;
+
+static const char *ModelName = NULL;
+
 /* Handles appending file */
 
 FILE *Output = NULL;
 
-/* Algo option provided by user in argc. */
+/* disk_open_flags options provided by user. */
+
+static int DiskFlags = 0;
+
+/* Backing files and stripe size when the disk is striped. */
+
+#define MAX_STRIPES 16
 
-static int UserOption = 0;
+static const char *StripeFiles[MAX_STRIPES];
+static int Stripes = 0;
+static int StripeBlocks = 16;
 
-/* Fault counters */
+static struct option LongOptions[] =
+{
+    {"direct",      no_argument,       NULL, 'd'},
+    {"sync",        required_argument, NULL, 's'},
+    {"backend",     required_argument, NULL, 'b'},
+    {"model",       required_argument, NULL, 'm'},
+    {"stripe",      required_argument, NULL, 'S'},
+    {"stripe-size", required_argument, NULL, 'Z'},
+    {"threads",     required_argument, NULL, 't'},
+    {"replacement", required_argument, NULL, 'r'},
+    {"sparse",      no_argument,       NULL, 'P'},
+    {"warm",        required_argument, NULL, 'w'},
+    {"dirty",       required_argument, NULL, 'D'},
+    {"seed",        required_argument, NULL, 'e'},
+    {"trials",      required_argument, NULL, 'T'},
+    {"page-size",   required_argument, NULL, 'p'},
+    {"extent",      required_argument, NULL, 'x'},
+    {"promote",     required_argument, NULL, 'X'},
+    {NULL,          0,                 NULL, 0}
+};
+
+/* Fault counters, bumped atomically by whichever thread faults. */
 
 static int Faults = 0;
 static int Writes = 0;
 static int Reads = 0;
 
-/* Counts number of frames occupied (random/custom) */ 
+#define COUNT(counter) __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
 
-static int counter = 0; 
+/*
+ * A set of frames that is filled and then recycled on its own, as
+ * handed to the policy.  With global replacement all tenants share one
+ * range covering the whole pool; with local replacement each tenant
+ * has its own slice.
+ */
 
-int *FrameArray;
+typedef struct frame_range FrameRange;
 
-/* FIFO data structures */
+/*
+ * One address space and the program running in it.
+ * Its pages live on the disk starting at block firstBlock.
+ */
 
-typedef struct FifoNode
+typedef struct Tenant
 {
-    int data;
-    struct FifoNode *next;
-} FifoNode;
+    int id;
+    const char *program;
+    double param;
+    struct page_table *pt;
+    long firstBlock;
+    FrameRange *frames;
+    int faults;
+    int reads;
+    int writes;
+    int resident;
+    int peakResident;
+    int *extentResident;
+    pthread_t thread;
+} Tenant;
 
-typedef struct FifoQueue
-{
-    int size;
-    struct FifoNode *front, *rear;
-    unsigned capacity;
-} FifoQueue;
+#define MAX_TENANTS 16
 
-FifoQueue *fifoq;
+static Tenant Tenants[MAX_TENANTS];
+static int TotalTenants = 0;
 
-void setup_fifo(int cap);
-void push_fifo(int page);
-int pop_fifo(void);
+static bool LocalReplacement = false;
 
-/* Set up for random algorithm. */
+/* Snapshot file for warm starts, if any. */
 
-void setup_frame_array(int cap);
+static const char *SnapshotFile = NULL;
 
-int cust_get_frame(struct page_table *pt);
+/* page_table_create_in_pool flags provided by user. */
 
-void FrameworkSetup(struct page_table *pt);
+static int PageTableFlags = 0;
 
 /*
- * FIFO agorithm for handling page faults.
- * Very basic fault handler which evicts pages based
- * solely on position in queue.
+ * Owner of each frame: tenant id in the high half, page number in the
+ * low half, or -1 while the frame is free or being refilled.
  */
 
-void fifo_fault_handler( struct page_table *pt, int page)
-{
-    /* Increment page fault counter. */
-    
-    Faults++;
+long *FrameArray;
 
-    /* Get information about the page. */
-    
-    int frame, bits;
-    
-    page_table_get_entry(pt, page, &frame, &bits);
-
-    /* if this page is not in memory */
-    
-    if (!bits&PROT_READ)
-    {
-        /* There will be a read. */
-        
-        Reads++;
-        
-        /* If not all frames are being used. */
-        
-        if (fifoq->size < fifoq->capacity)
-        {
-            /* It will take the next frame in the queue. */
-            
-            frame = fifoq->size;
-            disk_read(disk, page, &physmem[frame*PAGE_SIZE]);
-        }
-        else
-        {
-            /* We need to evict the front page in the queue. */
-            
-            int out_page = pop_fifo();
-            int out_frame, out_bits;
-            page_table_get_entry(pt, out_page, &out_frame, &out_bits);
+#define OWNER(tenant, page) (((long)(tenant) << 32) | (unsigned)(page))
+#define OWNER_TENANT(owner) ((int)((owner) >> 32))
+#define OWNER_PAGE(owner)   ((int)((owner) & 0xffffffff))
 
-            /* If the evicted frame is dirty, write it to the disk */
-            
-            if (out_bits&PROT_WRITE)
-            {
-                Writes++;
-                disk_write(disk, out_page, &physmem[out_frame*PAGE_SIZE]);
-            }
-            
-            disk_read(disk, page, &physmem[out_frame*PAGE_SIZE]);
-            page_table_set_entry(pt, out_page, 0, 0);
-            frame = out_frame;
-        }
-        /* Push page to queue */
-        push_fifo(page);
-        bits = PROT_READ;
-    }
-    
-    /* else, make it dirty */
-    
-    else
-    {
-        bits = PROT_READ|PROT_WRITE;
-    }
-    page_table_set_entry(pt,page,frame,bits);
+/*
+ * Eviction policy chosen by the user, and its private state.  A build
+ * with VIRTMEM_POLICY set to a built-in policy's name runs only that
+ * policy, and its callbacks are known at compile time.
+ */
 
-}
+#ifdef VIRTMEM_POLICY
+#define POLICY_OF(name) POLICY_OF_(name)
+#define POLICY_OF_(name) (&name##_policy)
+#define Policy POLICY_OF(VIRTMEM_POLICY)
+#else
+static const struct policy *Policy = NULL;
+#endif
+
+static void *PolicyState = NULL;
+
+/* Worker threads for the sort-mt and scan-mt programs. */
+
+static int Threads = 4;
 
 /*
- * FindPage finds a particular page in an array
- * Used by Custom and Random handlers
+ * How dirty pages are found.
+ * DIRTY_FAULT loads pages read-only and takes a fault on the first
+ * write to each, which makes it writable and marks it dirty.
+ * DIRTY_SOFT asks the kernel's soft-dirty bits instead.  A page is
+ * still loaded read-only, since a freshly mapped page always reads as
+ * soft-dirty, but every HarvestInterval loads the bits of all resident
+ * pages are folded into FrameDirty, cleared together, and the pages
+ * loaded since the last harvest are made writable without a fault.
+ * A write after that is only seen through the page's bit, which is
+ * read again when the page is evicted.  Clearing the bits is not
+ * atomic with reading them, so this needs a single faulting thread.
+ * DIRTY_ALWAYS loads pages writable and writes every evicted page
+ * back; it stands in for DIRTY_SOFT where the kernel lacks soft-dirty.
  */
 
-int FindPage(int* arr, int size, int key) 
-{
-      for (unsigned i = 0; i < size; i++) 
-      {
-            if (arr[i] == key)
-            {
-                return i;
-            }    
-      }
-    
-      return -1;
-}
+enum { DIRTY_FAULT, DIRTY_SOFT, DIRTY_ALWAYS };
+
+static int DirtyTracking = DIRTY_FAULT;
+
+static char *FrameDirty = NULL;
+static char *FrameFresh = NULL;
+static int HarvestInterval = 1;
+static int LoadsSinceHarvest = 0;
 
 /*
- * Custom Fault Handler
- * Eviction policy is based on random but gives
- * a second chance to any frame with PROT_WRITE
- * bit set.
+ * Seed of the policy's random numbers, so that runs repeat exactly.
+ * With Trials > 1 the run is repeated with seeds Seed, Seed+1, ...,
+ * each in a child process that reports its counts down TrialPipe.
  */
- 
-void cust_fault_handler(struct page_table *pt, int page)
-{
-    Faults++;
 
-    /* Get info about faulting frame. */
-    
-    int frame, bits;
-    
-    page_table_get_entry(pt, page, &frame, &bits);
-
-    /* If page is not in memory. */
-    
-    if (!bits&PROT_READ)
-    {
-        Reads++;
-        
-        /* If we still have unallocated frames. */
-        
-        if (counter < TotalFrames)
-        {
-             FrameArray[counter] = page;
-             counter++;
-             disk_read(disk, page, &physmem[frame*PAGE_SIZE]);
-        }
-        
-        /* Execute eviction policy */
-        
-        else
-        {
-            /* Find a frame to evict here. */
-            
-            int out_page = cust_get_frame(pt);
-            int out_frame, out_bits;
-            page_table_get_entry(pt, out_page, &out_frame, &out_bits);
-            
-            if (out_bits&PROT_WRITE)
-            {
-                Writes++;
-                disk_write(disk, out_page, &physmem[out_frame*PAGE_SIZE]);
-            }
-            
-            disk_read(disk, page, &physmem[out_frame*PAGE_SIZE]);
-            page_table_set_entry(pt, out_page, 0, 0);
-            frame = out_frame;
-            
-            /* put the new page into the FrameArray */
-            
-            int frame_index = FindPage(FrameArray, TotalFrames, out_page);
-            FrameArray[frame_index] = page;
-        }
-        
-        bits = PROT_READ;
-    }
-    
-    /* else make it dirty */
-    
-    else
+static unsigned long Seed = 1;
+static int Trials = 1;
+static int TrialPipe = -1;
+
+/* Size of every page, frame and disk block, from PAGE_SIZE to PAGE_SIZE_MAX. */
+
+static int PageSize = PAGE_SIZE;
+
+/*
+ * Extents.  With ExtentPages > 1 the pages are grouped into aligned
+ * extents of that many pages.  A fault in an extent that already has
+ * at least PromoteThreshold resident pages promotes it: every page of
+ * the extent not yet resident is loaded with the faulting one, in one
+ * disk_readv per run of blocks.  The extra pages are mapped with no
+ * access and marked Prefetched, so the first touch of each shows it
+ * was worth loading.  That touch traps without I/O and is counted in
+ * PrefetchHits, not in Faults, as a large page would not have faulted
+ * at all.  A prefetched page evicted, or left at exit, without ever
+ * being touched is counted in WastedBytes.  A threshold of 0 promotes
+ * on every fault, which pages the whole extent as one large page.
+ * The frames of an extent are held until all of it has been read, so
+ * extents being loaded at once may hold at most ExtentFrameBudget
+ * frames between them, a quarter of a range; a fault that finds the
+ * budget spent loads just its own page.
+ */
+
+#define EXTENT_MAX_PAGES 512
+
+static long ExtentBytes = 0;
+static int ExtentPages = 1;
+static double Promote = 0.5;
+static int PromoteThreshold = 0;
+static int ExtentFrameBudget = 0;
+static int ExtentFramesHeld = 0;
+static char *Prefetched = NULL;
+
+static long ReadBytes = 0;
+static long WriteBytes = 0;
+static long WastedBytes = 0;
+static int Promotions = 0;
+static int PrefetchHits = 0;
+
+/* Set up for the eviction policies. */
+
+void setup_frame_array(int cap);
+
+void FrameworkSetup(struct frame_pool *pool);
+
+/* Whether the page of tenant t in frame must be written back when it leaves. */
+
+bool frame_is_dirty(Tenant *t, int page, int frame, int bits)
+{
+    switch (DirtyTracking)
     {
-        bits = PROT_READ|PROT_WRITE;
+        case DIRTY_ALWAYS:
+            return !(Prefetched && Prefetched[frame]);
+        case DIRTY_SOFT:
+            return FrameDirty[frame] || (!FrameFresh[frame] && page_table_get_soft_dirty(t->pt, page) != 0);
+        default:
+            return (bits&PROT_WRITE) != 0;
     }
-   
-    /* Finally, set the page table entry. */
-    
-    page_table_set_entry(pt,page,frame,bits);
 }
 
 /*
- * Random Fault Handler
- * Chooses frames to evict purely randomly.
+ * Folds the soft-dirty bits of every resident page into FrameDirty,
+ * clears them, and makes the pages loaded since the last harvest
+ * writable.  Those still read-only have not been written, and from
+ * now on their bits will tell.
  */
- 
-void random_fault_handler(struct page_table *pt, int page)
-{
-    /* Increment page fault counter. */
-    
-    Faults++;
-
-    /* Get information about the page. */
-    
-    int frame, bits;
-    
-    page_table_get_entry(pt, page, &frame, &bits);
 
-    /* if this page is not in memory */
-    
-    if (!bits&PROT_READ)
+void harvest_soft_dirty(int nframes)
+{
+    for (int frame = 0; frame < nframes; frame++)
     {
-        /* There will be a read. */
-        
-        Reads++;
-        
-        /* If not all frames are being used. */
-        if (counter < TotalFrames)
+        long owner = FrameArray[frame];
+
+        if (owner >= 0 && !FrameFresh[frame] && !FrameDirty[frame] &&
+            page_table_get_soft_dirty(Tenants[OWNER_TENANT(owner)].pt, OWNER_PAGE(owner)) != 0)
         {
-            frame = counter;
-            disk_read(disk, page, &physmem[frame*PAGE_SIZE]);
-            counter++;
+            FrameDirty[frame] = 1;
         }
-        else
-        {
-            /* Evicting random page */
-            
-            int out_page = FrameArray[rand() % TotalFrames];
-            int out_frame, out_bits;
-            page_table_get_entry(pt, out_page, &out_frame, &out_bits);
+    }
 
-            /* If the evicted frame is dirty, write it to the disk */
-            
-            if (out_bits&PROT_WRITE)
+    page_table_clear_soft_dirty();
+
+    for (int frame = 0; frame < nframes; frame++)
+    {
+        long owner = FrameArray[frame];
+
+        if (owner >= 0 && FrameFresh[frame] && !(Prefetched && Prefetched[frame]))
+        {
+            if (!FrameDirty[frame])
             {
-                Writes++;
-                disk_write(disk, out_page, &physmem[out_frame*PAGE_SIZE]);
+                page_table_set_bits(Tenants[OWNER_TENANT(owner)].pt, OWNER_PAGE(owner), PROT_READ|PROT_WRITE);
             }
-            
-            disk_read(disk, page, &physmem[out_frame*PAGE_SIZE]);
-            page_table_set_entry(pt, out_page, 0, 0);
-            frame = out_frame;
+
+            FrameFresh[frame] = 0;
         }
-        FrameArray[frame] = page;
-        bits = PROT_READ;
-    }
-    
-    /* else, make it dirty */
-    
-    else
-    {
-        bits = PROT_READ|PROT_WRITE;
     }
-    page_table_set_entry(pt,page,frame,bits);
 
+    LoadsSinceHarvest = 0;
 }
 
 /*
- * Naive page fault handler
+ * Finds a frame for a page of tenant t that is being loaded: a free
+ * frame of its range while there are any, otherwise one emptied by the
+ * eviction policy.  Under global replacement the victim may belong to
+ * any tenant.  The victim is claimed through its page state, so two
+ * threads never evict the same page, and it is made inaccessible
+ * before it is written out, so no thread can change it while it is
+ * being saved.
  */
- 
-void page_fault_handler( struct page_table *pt, int page )
-{
-    printf("page fault on page #%d\n",page);
-    page_table_set_entry(pt,page,page,PROT_READ|PROT_WRITE);
-    page_table_print(pt);
-}
 
-int main(int argc, char *argv[])
+int get_frame(Tenant *t)
 {
-    if (argc != 5) 
+    FrameRange *range = t->frames;
+    int used = __atomic_load_n(&range->used, __ATOMIC_RELAXED);
+
+    /* Claim a free frame without ever taking used past count, which snapshots record. */
+
+    while (used < range->count)
     {
-        printf("use: virtmem <npages> <nframes> <rand|fifo|custom> <sort|scan|focus>\n");
-        return 1;
+        if (__atomic_compare_exchange_n(&range->used, &used, used + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            return range->first + used;
+        }
     }
 
-    int npages = atoi(argv[1]);
-    int nframes = atoi(argv[2]);
+    while (1)
+    {
+        int frame = Policy->pick_victim(PolicyState, range);
+        long owner = __atomic_load_n(&FrameArray[frame], __ATOMIC_ACQUIRE);
 
-    char *outputFile;
+        if (owner < 0)
+        {
+            continue;
+        }
 
-    /* Checks options provided */
+        Tenant *victim = &Tenants[OWNER_TENANT(owner)];
+        int out_page = OWNER_PAGE(owner);
 
-    if (!strcmp(argv[3], "rand"))
-    {
-        setup_frame_array(nframes);
-        UserOption = 1;
-        srand(time(NULL));
+        if (!page_table_try_state(victim->pt, out_page, PAGE_RESIDENT, PAGE_EVICTING))
+        {
+            continue;
+        }
+
+        int out_frame, out_bits;
+        page_table_get_entry(victim->pt, out_page, &out_frame, &out_bits);
+
+        /* The page moved to another frame since we looked; try again. */
+
+        if (out_frame != frame)
+        {
+            page_table_set_state(victim->pt, out_page, PAGE_RESIDENT);
+            continue;
+        }
+
+        /* Soft-dirty bits must be read before the page is unmapped, which sets them. */
+
+        bool dirty = frame_is_dirty(victim, out_page, out_frame, out_bits);
+
+        __atomic_store_n(&FrameArray[frame], -1, __ATOMIC_RELEASE);
+        page_table_set_entry(victim->pt, out_page, out_frame, 0);
+
+        /* If the evicted frame is dirty, write it to the disk */
+
+        if (dirty)
+        {
+            COUNT(Writes);
+            COUNT(victim->writes);
+            __atomic_fetch_add(&WriteBytes, PageSize, __ATOMIC_RELAXED);
+            disk_write(disk, victim->firstBlock + out_page, &physmem[(size_t)out_frame*PageSize]);
+        }
+
+        if (Prefetched && Prefetched[frame])
+        {
+            Prefetched[frame] = 0;
+            __atomic_fetch_add(&WastedBytes, PageSize, __ATOMIC_RELAXED);
+        }
+
+        if (victim->extentResident)
+        {
+            __atomic_fetch_sub(&victim->extentResident[out_page / ExtentPages], 1, __ATOMIC_RELAXED);
+        }
+
+        __atomic_fetch_sub(&victim->resident, 1, __ATOMIC_RELAXED);
+        page_table_set_state(victim->pt, out_page, PAGE_UNMAPPED);
+
+        if (Policy->on_evict)
+        {
+            Policy->on_evict(PolicyState, frame, owner);
+        }
+
+        return frame;
     }
-    else if (!strcmp(argv[3], "fifo"))
+}
+
+/* Access bits a page is loaded with. */
+
+#define LOAD_BITS (DirtyTracking == DIRTY_ALWAYS ? PROT_READ|PROT_WRITE : PROT_READ)
+
+/*
+ * Bookkeeping once page of tenant t has been read into frame and
+ * mapped: the page becomes resident and the policy is told.
+ */
+
+void finish_load(Tenant *t, int page, int frame)
+{
+    if (DirtyTracking == DIRTY_SOFT)
     {
-        setup_fifo(nframes);
-        UserOption = 2;
+        FrameDirty[frame] = 0;
+        FrameFresh[frame] = 1;
     }
-    else if (!strcmp(argv[3], "custom"))
+
+    if (t->extentResident)
     {
-        setup_frame_array(nframes);
-        UserOption = 3;
-        srand(time(NULL));
+        __atomic_fetch_add(&t->extentResident[page / ExtentPages], 1, __ATOMIC_RELAXED);
     }
 
-    const char *program = argv[4];
+    /* Track the largest resident set this tenant reaches. */
 
-    if (npages < 3) 
+    int resident = __atomic_add_fetch(&t->resident, 1, __ATOMIC_RELAXED);
+    int peak = __atomic_load_n(&t->peakResident, __ATOMIC_RELAXED);
+
+    while (resident > peak && !__atomic_compare_exchange_n(&t->peakResident, &peak, resident, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        printf("Your page count is too small. The minimum number of page required is 3.\n");
-        return 1;
     }
 
-    if (nframes < 3) 
+    __atomic_store_n(&FrameArray[frame], OWNER(t->id, page), __ATOMIC_RELEASE);
+
+    if (Policy->on_fault)
     {
-        printf("Your frame count is too small. The minimum number of frames required is 3.\n");
-        return 1;
+        Policy->on_fault(PolicyState, frame, OWNER(t->id, page));
     }
 
+    page_table_set_state(t->pt, page, PAGE_RESIDENT);
+}
 
-    disk = disk_open("myvirtualdisk",npages);
+/*
+ * Takes the frames of one extent out of ExtentFrameBudget, or returns
+ * false if extents already being loaded hold too many.  Without the
+ * budget they could hold every frame, and get_frame would find
+ * nothing it can evict.
+ */
 
-    if (!disk) 
+bool reserve_extent_frames(void)
+{
+    int held = __atomic_load_n(&ExtentFramesHeld, __ATOMIC_RELAXED);
+
+    do
     {
-        fprintf(stderr,"couldn't create virtual disk: %s\n",strerror(errno));
-        return 1;
-    }
+        if (held + ExtentPages > ExtentFrameBudget)
+        {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&ExtentFramesHeld, &held, held + ExtentPages, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
-    struct page_table *pt = NULL;
+    return true;
+}
 
-    /* Handles FIFO */
+/*
+ * Promotes the extent holding page, which the caller has claimed:
+ * claims every other page of the extent that is not resident, finds
+ * frames for them all, and reads each run of consecutive blocks with
+ * one disk_readv.  Pages another thread is busy with are left alone.
+ */
 
-    if (UserOption == 2)
-    {
-        pt = page_table_create( npages, nframes, fifo_fault_handler);
-    }
-    
-    /* Handles Random */
-    
-    else if (UserOption == 1)
-    {
-        pt = page_table_create( npages, nframes, random_fault_handler);
-        FrameworkSetup(pt);
-    }
-    
-    /* Custom */
-    
-    else if (UserOption == 3)
+void load_extent(Tenant *t, int page)
+{
+    int first = page - page % ExtentPages;
+    int last = first + ExtentPages;
+    int frames[EXTENT_MAX_PAGES];
+    char *data[EXTENT_MAX_PAGES];
+
+    if (last > page_table_get_npages(t->pt))
     {
-        pt = page_table_create( npages, nframes, cust_fault_handler);
-        FrameworkSetup(pt);
+        last = page_table_get_npages(t->pt);
     }
 
-    else
+    for (int p = first; p < last; p++)
     {
-        printf("Unknown option!: %d\n", UserOption);
-        exit(0);
+        if (p == page || page_table_try_state(t->pt, p, PAGE_UNMAPPED, PAGE_LOADING))
+        {
+            frames[p - first] = get_frame(t);
+        }
+        else
+        {
+            frames[p - first] = -1;
+        }
     }
 
-    if(!pt) 
+    for (int p = first; p < last; )
     {
-        fprintf(stderr,"couldn't create page table: %s\n",strerror(errno));
-        return 1;
-    }
+        int count = 0;
 
-    char *virtmem = page_table_get_virtmem(pt);
+        while (p + count < last && frames[p + count - first] >= 0)
+        {
+            data[count] = &physmem[(size_t)frames[p + count - first]*PageSize];
+            count++;
+        }
 
-    physmem = page_table_get_physmem(pt);
+        if (count > 0)
+        {
+            COUNT(Reads);
+            COUNT(t->reads);
+            __atomic_fetch_add(&ReadBytes, (long)count*PageSize, __ATOMIC_RELAXED);
+            disk_readv(disk, t->firstBlock + p, count, data);
+        }
 
+        p += count ? count : 1;
+    }
 
-    if(!strcmp(program,"sort")) 
+    for (int p = first; p < last; p++)
     {
-        sort_program(virtmem,npages*PAGE_SIZE);
-        outputFile = "sort_results.csv";
+        int frame = frames[p - first];
 
-    } 
-    else if(!strcmp(program,"scan")) 
-    {
-        scan_program(virtmem,npages*PAGE_SIZE);
-        outputFile = "scan_results.csv";
+        if (frame < 0)
+        {
+            continue;
+        }
 
-    } 
-    else if(!strcmp(program,"focus")) 
-    {
-        focus_program(virtmem,npages*PAGE_SIZE);
-        outputFile = "focus_results.csv";
+        if (p == page)
+        {
+            page_table_set_entry(t->pt, p, frame, LOAD_BITS);
+        }
+        else
+        {
+            Prefetched[frame] = 1;
+            page_table_set_entry(t->pt, p, frame, 0);
+        }
 
-    } 
-    else 
-    {
-        fprintf(stderr,"unknown program: %s\n",argv[3]);
+        finish_load(t, p, frame);
     }
 
-    Output = fopen(outputFile, "a");
+    COUNT(Promotions);
+}
+
+/*
+ * Page fault handler shared by every policy and every tenant.
+ * Runs on the faulting thread, possibly on several threads at once.
+ * A fault on an unmapped page loads it read-only; a fault on a
+ * resident page means it is being written to, so it is made writable
+ * and from then on counts as dirty.  A thread that finds the page
+ * being loaded or evicted by another thread waits for that to finish
+ * and then retries its access.
+ */
+
+void fault_handler(struct page_table *pt, int page)
+{
+    Tenant *t = page_table_get_data(pt);
+
+    COUNT(Faults);
+    COUNT(t->faults);
+
+    int frame, bits;
+    int state = page_table_get_state(pt, page);
 
-    if (NULL != Output)
+    if (state == PAGE_UNMAPPED)
     {
-        fseek(Output, 0, SEEK_END);
-        int size = ftell(Output);
+        if (!page_table_try_state(pt, page, PAGE_UNMAPPED, PAGE_LOADING))
+        {
+            return;
+        }
 
-        if (size == 0)
+        if (t->extentResident && __atomic_load_n(&t->extentResident[page / ExtentPages], __ATOMIC_RELAXED) >= PromoteThreshold &&
+            reserve_extent_frames())
+        {
+            load_extent(t, page);
+            __atomic_fetch_sub(&ExtentFramesHeld, ExtentPages, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            COUNT(Reads);
+            COUNT(t->reads);
+            __atomic_fetch_add(&ReadBytes, PageSize, __ATOMIC_RELAXED);
+
+            frame = get_frame(t);
+            disk_read(disk, t->firstBlock + page, &physmem[(size_t)frame*PageSize]);
+            page_table_set_entry(pt, page, frame, LOAD_BITS);
+            finish_load(t, page, frame);
+        }
+
+        if (DirtyTracking == DIRTY_SOFT && ++LoadsSinceHarvest >= HarvestInterval)
         {
-            fprintf(Output, "Frames,Pages,Faults,Reads,Writes\n");
+            harvest_soft_dirty(page_table_get_nframes(pt));
         }
     }
+    else if (state == PAGE_RESIDENT)
+    {
+        if (!page_table_try_state(pt, page, PAGE_RESIDENT, PAGE_LOADING))
+        {
+            return;
+        }
 
-    printf("\nFrames: %d, Pages: %d, Faults: %d, Reads: %d, Writes: %d\n", nframes, npages, Faults, Reads, Writes);
+        page_table_get_entry(pt, page, &frame, &bits);
 
-    fprintf(Output, "%d, %d, %d, %d, %d\n", nframes, npages, Faults, Reads, Writes);
+        /*
+         * First touch of a prefetched page: make it accessible, no I/O
+         * needed.  Had the extent been one large page this access would
+         * not have faulted, so it counts as a prefetch hit instead.
+         */
 
-    fclose(Output);
+        if (bits == 0)
+        {
+            page_table_set_bits(pt, page, LOAD_BITS);
+            Prefetched[frame] = 0;
+            COUNT(PrefetchHits);
+            __atomic_fetch_sub(&Faults, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&t->faults, 1, __ATOMIC_RELAXED);
+        }
 
-    page_table_delete(pt);
-    disk_close(disk);
+        /*
+         * Make it dirty, unless another thread already has.  A read
+         * that raced with another thread's load of the page finds it
+         * readable already and needs nothing.
+         */
 
-    return 0;
-}
+        else if (!(bits&PROT_WRITE) && page_table_fault_is_write())
+        {
+            page_table_set_entry(pt, page, frame, PROT_READ|PROT_WRITE);
 
-/*
- * Sets up int array of frame numbers
- * based on a based capacity.
- * Initializes all indices to -1
- */
- 
-void setup_frame_array(int cap)
-{
-    FrameArray = (int *)malloc(cap * sizeof(int));
+            if (DirtyTracking == DIRTY_SOFT)
+            {
+                FrameDirty[frame] = 1;
+            }
 
-    for (unsigned i = 0; i < cap; i++)
+            if (Policy->on_access_upgrade)
+            {
+                Policy->on_access_upgrade(PolicyState, frame);
+            }
+        }
+
+        page_table_set_state(pt, page, PAGE_RESIDENT);
+    }
+    else
     {
-        FrameArray[i] = -1;
+        page_table_wait_state(pt, page, state);
     }
 }
 
 /*
- * Creates FIFO queue.
+ * Naive page fault handler
  */
  
-void setup_fifo(int cap)
+void page_fault_handler( struct page_table *pt, int page )
 {
-    FifoQueue *q = (FifoQueue*)malloc(sizeof(FifoQueue));
-    q->capacity = cap;
-    q->size = 0;
+    printf("page fault on page #%d\n",page);
+    page_table_set_entry(pt,page,page,PROT_READ|PROT_WRITE);
+    page_table_print(pt);
+}
+
+/* The programs a tenant can run. */
 
-    fifoq = q;
+static void sort_mt(char *data, size_t length)
+{
+    sort_program_mt(data, length, Threads);
 }
 
-/* 
- * Pushes an int page number to the back
- * of the FIFO queue
- */
+static void scan_mt(char *data, size_t length)
+{
+    scan_program_mt(data, length, Threads);
+}
 
-void push_fifo(int page)
+static void zipf(char *data, size_t length, double skew)
 {
-    FifoNode *n = (FifoNode*)malloc(sizeof(FifoNode));
-    n->data = page;
+    zipf_program(data, length, skew);
+}
 
-    if (fifoq->size > 0)
-    {
-        fifoq->rear->next = n;
-        fifoq->rear = n;
-    }
-    else
-    {
-        fifoq->front = n;
-        fifoq->rear = n;
-    }
-    
-    fifoq->size = fifoq->size + 1;
+static void stride(char *data, size_t length, double bytes)
+{
+    stride_program(data, length, (size_t)bytes);
 }
 
-/*
- * Pops an int page number from
- * the front of the FIFO queue
- */
- 
-int pop_fifo(void)
+static void matmul_blocked(char *data, size_t length, double tile)
 {
-    FifoNode *n = fifoq->front;
-    int i = n->data;
+    matmul_blocked_program(data, length, (size_t)tile);
+}
 
-    fifoq->front = n->next;
-    free(n);
-    fifoq->size = fifoq->size - 1;
-    return i;
+static void loop(char *data, size_t length, double passes)
+{
+    loop_program(data, length, (int)passes);
 }
 
 /*
- * Finds a frame to evict based on a random, second-chance
- * policy:
- * 1. Select a random frame.
- * 2. If the PROT_EXEC bit is set, unset it and look again.
- * 3. If it is not set, return that page.
+ * A program either takes no argument, or takes one number written after
+ * a colon, as in "zipf:0.8", which must lie in [min, max].
  */
 
-int cust_get_frame(struct page_table *pt)
+typedef struct Program
 {
-    while(1)
+    const char *name;
+    void (*run)(char *data, size_t length);
+    void (*runWith)(char *data, size_t length, double param);
+    double param;
+    double min;
+    double max;
+} Program;
+
+static const Program Programs[] =
+{
+    {"sort",           sort_program},
+    {"scan",           scan_program},
+    {"focus",          focus_program},
+    {"sort-mt",        sort_mt},
+    {"scan-mt",        scan_mt},
+    {"zipf",           NULL, zipf,           0.99, 0.01, 0.999},
+    {"stride",         NULL, stride,         8192, 1,    1e12},
+    {"matmul",         matmul_program},
+    {"matmul-blocked", NULL, matmul_blocked, 32,   1,    1e6},
+    {"chase",          chase_program},
+    {"hash",           hash_program},
+    {"loop",           NULL, loop,           10,   1,    1e6},
+    {NULL,             NULL}
+};
+
+const Program * find_program(const char *name)
+{
+    for (const Program *p = Programs; p->name; p++)
     {
-        int page = FrameArray[rand() % TotalFrames];
-        int frame, bits;
-        page_table_get_entry(pt, page, &frame, &bits);
-        if(bits&PROT_EXEC)
-        {
-            bits = PROT_READ|PROT_WRITE;
-            page_table_set_entry(pt, page, frame, bits);
-        }
-        else
+        if (!strcmp(p->name, name))
         {
-            return page;
+            return p;
         }
     }
+
+    return NULL;
+}
+
+/*
+ * Runs a tenant's program over its whole virtual memory.
+ * Used directly, or as the body of the tenant's thread.
+ */
+
+void * run_tenant(void *arg)
+{
+    Tenant *t = arg;
+
+    const Program *p = find_program(t->program);
+    char *data = page_table_get_virtmem(t->pt);
+    size_t length = (size_t)page_table_get_npages(t->pt)*PageSize;
+
+    if (p->runWith)
+    {
+        p->runWith(data, length, t->param);
+    }
+    else
+    {
+        p->run(data, length);
+    }
+
+    return NULL;
+}
+
+/*
+ * Warm-start snapshots.
+ * At exit every dirty resident page is written back, so the disk holds
+ * the current contents of every page, and then the resident set is
+ * recorded: which tenant's page sits in each frame, plus how far each
+ * frame range has been filled and where its FIFO hand points.
+ * At startup the same pages are read straight back into the same
+ * frames before any program runs.  The blocks are sorted and runs of
+ * consecutive blocks are read with one disk_readv each.
+ */
+
+typedef struct SnapshotHeader
+{
+    char magic[8];
+    int pageSize;
+    int npages;
+    int nframes;
+    int tenants;
+    int local;
+} SnapshotHeader;
+
+typedef struct SnapshotFrame
+{
+    int tenant;
+    int page;
+} SnapshotFrame;
+
+static const char SnapshotMagic[8] = "VMSNAP1";
+
+int save_snapshot(const char *file, FrameRange *ranges, int nranges, int npages, int nframes)
+{
+    char tmp[4096];
+    SnapshotHeader h;
+    SnapshotFrame f;
+
+    for (int frame = 0; frame < nframes; frame++)
+    {
+        long owner = FrameArray[frame];
+
+        if (owner < 0)
+        {
+            continue;
+        }
+
+        Tenant *t = &Tenants[OWNER_TENANT(owner)];
+        int out_frame, out_bits;
+        page_table_get_entry(t->pt, OWNER_PAGE(owner), &out_frame, &out_bits);
+
+        if (frame_is_dirty(t, OWNER_PAGE(owner), frame, out_bits))
+        {
+            disk_write(disk, t->firstBlock + OWNER_PAGE(owner), &physmem[(size_t)frame*PageSize]);
+        }
+    }
+
+    disk_sync(disk);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+
+    FILE *out = fopen(tmp, "w");
+
+    if (NULL == out)
+    {
+        return -1;
+    }
+
+    memcpy(h.magic, SnapshotMagic, sizeof(h.magic));
+    h.pageSize = PageSize;
+    h.npages = npages;
+    h.nframes = nframes;
+    h.tenants = TotalTenants;
+    h.local = LocalReplacement;
+
+    /* A short write must never replace a good snapshot. */
+
+    bool written = fwrite(&h, sizeof(h), 1, out) == 1 &&
+                   fwrite(ranges, sizeof(FrameRange), nranges, out) == nranges;
+
+    for (int frame = 0; written && frame < nframes; frame++)
+    {
+        long owner = FrameArray[frame];
+
+        f.tenant = owner < 0 ? -1 : OWNER_TENANT(owner);
+        f.page = owner < 0 ? -1 : OWNER_PAGE(owner);
+        written = fwrite(&f, sizeof(f), 1, out) == 1;
+    }
+
+    if (fclose(out) != 0 || !written || rename(tmp, file) != 0)
+    {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Checks that every frame of a snapshot names a page of one of this
+ * run's tenants, inside the part of the tenant's frame range that the
+ * saved range says is filled.
+ */
+
+bool snapshot_frames_valid(SnapshotFrame *frames, FrameRange *saved, FrameRange *ranges, int nranges, int npages, int nframes)
+{
+    for (int i = 0; i < nranges; i++)
+    {
+        if (saved[i].used < 0 || saved[i].used > ranges[i].count)
+        {
+            return false;
+        }
+    }
+
+    for (int frame = 0; frame < nframes; frame++)
+    {
+        int tenant = frames[frame].tenant;
+
+        if (tenant == -1)
+        {
+            continue;
+        }
+
+        if (tenant < 0 || tenant >= TotalTenants || frames[frame].page < 0 || frames[frame].page >= npages)
+        {
+            return false;
+        }
+
+        int r = LocalReplacement ? tenant : 0;
+
+        if (frame < ranges[r].first || frame >= ranges[r].first + saved[r].used)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int compare_blocks(const void *pa, const void *pb)
+{
+    const long *a = pa;
+    const long *b = pb;
+
+    return (*a > *b) - (*a < *b);
+}
+
+/*
+ * Restores a snapshot taken with the same geometry.
+ * Returns the number of pages loaded, and the number of
+ * disk reads it took in *reads, or -1 if there is no
+ * usable snapshot.
+ */
+
+int load_snapshot(const char *file, FrameRange *ranges, int nranges, int npages, int nframes, int *reads)
+{
+    SnapshotHeader h;
+    int loaded = 0;
+
+    *reads = 0;
+
+    FILE *in = fopen(file, "r");
+
+    if (NULL == in)
+    {
+        return -1;
+    }
+
+    if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, SnapshotMagic, sizeof(h.magic)) ||
+        h.pageSize != PageSize || h.npages != npages || h.nframes != nframes ||
+        h.tenants != TotalTenants || h.local != LocalReplacement)
+    {
+        fprintf(stderr,"%s: snapshot does not match this run, starting cold\n",file);
+        fclose(in);
+        return -1;
+    }
+
+    FrameRange *saved = malloc(sizeof(FrameRange) * nranges);
+    SnapshotFrame *frames = malloc(sizeof(SnapshotFrame) * nframes);
+
+    if (fread(saved, sizeof(FrameRange), nranges, in) != nranges ||
+        fread(frames, sizeof(SnapshotFrame), nframes, in) != nframes)
+    {
+        fprintf(stderr,"%s: snapshot is truncated, starting cold\n",file);
+        free(saved);
+        free(frames);
+        fclose(in);
+        return -1;
+    }
+
+    fclose(in);
+
+    if (!snapshot_frames_valid(frames, saved, ranges, nranges, npages, nframes))
+    {
+        fprintf(stderr,"%s: snapshot is corrupt, starting cold\n",file);
+        free(saved);
+        free(frames);
+        return -1;
+    }
+
+    /*
+     * Pair each occupied frame with its disk block: the frame, which is
+     * below PTE_MAX_FRAMES, in the low ORDER_SHIFT bits and the block
+     * above them.
+     */
+
+#define ORDER_SHIFT       (32 - PTE_FRAME_SHIFT)
+#define ORDER_BLOCK(pair) ((pair) >> ORDER_SHIFT)
+#define ORDER_FRAME(pair) ((int)((pair) & (PTE_MAX_FRAMES - 1)))
+
+    long *order = malloc(sizeof(long) * nframes);
+    char **data = malloc(sizeof(char *) * nframes);
+
+    for (int frame = 0; frame < nframes; frame++)
+    {
+        if (frames[frame].tenant >= 0)
+        {
+            long block = Tenants[frames[frame].tenant].firstBlock + frames[frame].page;
+            order[loaded++] = (block << ORDER_SHIFT) | frame;
+        }
+    }
+
+    qsort(order, loaded, sizeof(long), compare_blocks);
+
+    /* Two frames holding the same page would map it twice. */
+
+    for (int i = 1; i < loaded; i++)
+    {
+        if (ORDER_BLOCK(order[i]) == ORDER_BLOCK(order[i - 1]))
+        {
+            fprintf(stderr,"%s: snapshot holds a page twice, starting cold\n",file);
+            free(order);
+            free(data);
+            free(saved);
+            free(frames);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < loaded; )
+    {
+        long first = ORDER_BLOCK(order[i]);
+        int count = 0;
+
+        while (i + count < loaded && ORDER_BLOCK(order[i + count]) == first + count)
+        {
+            data[count] = &physmem[(size_t)ORDER_FRAME(order[i + count]) * PageSize];
+            count++;
+        }
+
+        disk_readv(disk, first, count, data);
+        (*reads)++;
+        i += count;
+    }
+
+    for (int frame = 0; frame < nframes; frame++)
+    {
+        if (frames[frame].tenant < 0)
+        {
+            continue;
+        }
+
+        Tenant *t = &Tenants[frames[frame].tenant];
+        int page = frames[frame].page;
+
+        page_table_set_entry(t->pt, page, frame, DirtyTracking == DIRTY_ALWAYS ? PROT_READ|PROT_WRITE : PROT_READ);
+        page_table_set_state(t->pt, page, PAGE_RESIDENT);
+
+        if (DirtyTracking == DIRTY_SOFT)
+        {
+            FrameFresh[frame] = 1;
+        }
+        FrameArray[frame] = OWNER(t->id, page);
+        t->resident++;
+
+        if (t->extentResident)
+        {
+            t->extentResident[page / ExtentPages]++;
+        }
+
+        if (Policy->on_fault)
+        {
+            Policy->on_fault(PolicyState, frame, OWNER(t->id, page));
+        }
+
+        t->peakResident = t->resident;
+    }
+
+    for (int i = 0; i < nranges; i++)
+    {
+        ranges[i].used = saved[i].used;
+        ranges[i].hand = saved[i].hand;
+    }
+
+    free(order);
+    free(data);
+    free(saved);
+    free(frames);
+
+    return loaded;
+}
+
+/*
+ * Trials.  Each trial is a whole run in a child process, one after
+ * another so they do not compete for the CPU or the disk file.
+ * run_trials returns 0 in each child, which carries on with the run,
+ * and in the parent once every trial is done and the mean and 95%
+ * confidence interval of each count have been printed.
+ */
+
+/* Two-sided 97.5% points of Student's t for 1 to 30 degrees of freedom. */
+
+static const double StudentT[30] =
+{
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
+
+void print_interval(const char *name, double *samples, int n)
+{
+    double mean = 0, var = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        mean += samples[i];
+    }
+
+    mean /= n;
+
+    for (int i = 0; i < n; i++)
+    {
+        var += (samples[i] - mean) * (samples[i] - mean);
+    }
+
+    var /= n - 1;
+
+    double t = n - 1 <= 30 ? StudentT[n - 2] : 1.960;
+    double half = t * sqrt(var / n);
+
+    printf("%s: %.1f +/- %.1f (95%% CI %.1f to %.1f)\n", name, mean, half, mean - half, mean + half);
+}
+
+int run_trials(void)
+{
+    double *samples = malloc(sizeof(double) * 3 * Trials);
+    unsigned long first = Seed;
+
+    for (int i = 0; i < Trials; i++)
+    {
+        int fds[2];
+        int counts[3];
+
+        if (pipe(fds) < 0)
+        {
+            perror("pipe");
+            return -1;
+        }
+
+        fflush(stdout);
+
+        pid_t pid = fork();
+
+        if (pid < 0)
+        {
+            perror("fork");
+            return -1;
+        }
+
+        if (pid == 0)
+        {
+            close(fds[0]);
+            TrialPipe = fds[1];
+            Seed = first + i;
+            free(samples);
+            return 0;
+        }
+
+        close(fds[1]);
+
+        int got = read(fds[0], counts, sizeof(counts));
+        int status;
+
+        close(fds[0]);
+        waitpid(pid, &status, 0);
+
+        if (got != sizeof(counts))
+        {
+            fprintf(stderr,"trial with seed %lu failed\n", first + i);
+            free(samples);
+            return -1;
+        }
+
+        for (int j = 0; j < 3; j++)
+        {
+            samples[j * Trials + i] = counts[j];
+        }
+    }
+
+    printf("\nTrials: %d, Seeds: %lu to %lu\n", Trials, first, first + Trials - 1);
+    print_interval("Faults", &samples[0], Trials);
+    print_interval("Reads", &samples[Trials], Trials);
+    print_interval("Writes", &samples[2 * Trials], Trials);
+
+    free(samples);
+
+    return 0;
+}
+
+/*
+ * Appends one line to a CSV file, writing the header
+ * first if the file is new.
+ */
+
+FILE * open_results(const char *outputFile, const char *header)
+{
+    FILE *f = fopen(outputFile, "a");
+
+    if (NULL != f)
+    {
+        fseek(f, 0, SEEK_END);
+        int size = ftell(f);
+
+        if (size == 0)
+        {
+            fprintf(f, "%s\n", header);
+        }
+    }
+
+    return f;
+}
+
+void usage(void)
+{
+    printf("use: virtmem [options] <npages> <nframes> <policy> <program>[,<program>...]\n");
+    printf("policies: ");
+    policy_print_names(stdout);
+    printf(", or the path of a policy plugin such as ./policy_clock.so\n");
+    printf("programs: sort scan focus sort-mt scan-mt matmul chase hash\n");
+    printf("          zipf[:skew] stride[:bytes] matmul-blocked[:tile] loop[:passes]\n");
+    printf("Each program listed runs in its own address space of npages pages, on its own\n");
+    printf("thread, and all of them share the same nframes frames.\n");
+    printf("options:\n");
+    printf("  -d, --direct                   open the virtual disk with O_DIRECT\n");
+    printf("  -s, --sync <dsync|fdatasync>   make every disk write durable\n");
+    printf("  -b, --backend <pread|mmap>     how blocks move to and from the disk\n");
+    printf("  -m, --model <hdd|ssd>          report the paging time of a modeled device\n");
+    printf("  -S, --stripe <file,file,...>   stripe the disk across these files\n");
+    printf("  -Z, --stripe-size <blocks>     consecutive blocks per stripe (default 16)\n");
+    printf("  -t, --threads <n>              threads for sort-mt and scan-mt (default 4)\n");
+    printf("  -r, --replacement <global|local>\n");
+    printf("                                 evict from any address space, or only from\n");
+    printf("                                 the faulting one's equal share of the frames\n");
+    printf("  -P, --sparse                   allocate page table entries on first use\n");
+    printf("  -w, --warm <file>              start with the resident set saved in file, if\n");
+    printf("                                 it exists, and save it there at exit\n");
+    printf("  -e, --seed <n>                 seed of the policy's random numbers (default 1)\n");
+    printf("  -T, --trials <n>               repeat the run with n seeds from --seed on, and\n");
+    printf("                                 report the mean and 95%% confidence intervals\n");
+    printf("  -D, --dirty <fault|soft|always>\n");
+    printf("                                 find dirty pages by write faults (default),\n");
+    printf("                                 by the kernel's soft-dirty bits, or treat\n");
+    printf("                                 every evicted page as dirty\n");
+    printf("  -p, --page-size <bytes>        size of pages, frames and disk blocks, a power\n");
+    printf("                                 of two from 4K to 2M (default 4K)\n");
+    printf("  -x, --extent <bytes>           group pages into extents of this size and\n");
+    printf("                                 load a whole extent once it is busy enough\n");
+    printf("  -X, --promote <fraction>       resident fraction of an extent that promotes\n");
+    printf("                                 it (default 0.5), 0 always loads whole extents,\n");
+    printf("                                 1 only those missing just the faulting page\n");
+}
+
+/*
+ * Parses a size in bytes with an optional K or M suffix,
+ * returns -1 if it is malformed.
+ */
+
+long parse_size(const char *text)
+{
+    char *end;
+    long size = strtol(text, &end, 0);
+    long unit = 1;
+
+    if (*end == 'k' || *end == 'K')
+    {
+        unit = 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        unit = 1024 * 1024;
+        end++;
+    }
+
+    if (size > LONG_MAX / unit)
+    {
+        return -1;
+    }
+
+    size *= unit;
+
+    return end == text || *end || size <= 0 ? -1 : size;
+}
+
+/*
+ * Parses a count from 0 to max,
+ * returns -1 if it is malformed or out of range.
+ */
+
+int parse_count(const char *text, long max)
+{
+    char *end;
+    long count = strtol(text, &end, 10);
+
+    return end == text || *end || count < 0 || count > max ? -1 : (int)count;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "ds:b:m:S:Z:t:r:Pw:D:e:T:p:x:X:", LongOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'd':
+                DiskFlags |= DISK_DIRECT;
+                break;
+            case 's':
+                if (!strcmp(optarg, "dsync"))
+                {
+                    DiskFlags |= DISK_DSYNC;
+                }
+                else if (!strcmp(optarg, "fdatasync"))
+                {
+                    DiskFlags |= DISK_FDATASYNC;
+                }
+                else
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'b':
+                if (!strcmp(optarg, "mmap"))
+                {
+                    DiskFlags |= DISK_MMAP;
+                }
+                else if (strcmp(optarg, "pread"))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'm':
+                ModelName = optarg;
+                break;
+            case 'S':
+                for (char *file = strtok(optarg, ","); file; file = strtok(NULL, ","))
+                {
+                    if (Stripes == MAX_STRIPES)
+                    {
+                        fprintf(stderr,"at most %d stripes are supported\n",MAX_STRIPES);
+                        return 1;
+                    }
+                    StripeFiles[Stripes++] = file;
+                }
+                break;
+            case 'Z':
+                StripeBlocks = atoi(optarg);
+                break;
+            case 't':
+                Threads = atoi(optarg);
+
+                if (Threads < 1)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (!strcmp(optarg, "local"))
+                {
+                    LocalReplacement = true;
+                }
+                else if (strcmp(optarg, "global"))
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'P':
+                PageTableFlags |= PAGE_TABLE_SPARSE;
+                break;
+            case 'w':
+                SnapshotFile = optarg;
+                break;
+            case 'e':
+                Seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'T':
+                Trials = atoi(optarg);
+
+                if (Trials < 1)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'p':
+            {
+                long size = parse_size(optarg);
+
+                if (size < PAGE_SIZE || size > PAGE_SIZE_MAX || (size & (size - 1)))
+                {
+                    fprintf(stderr,"the page size must be a power of two from %d to %d bytes\n",PAGE_SIZE,PAGE_SIZE_MAX);
+                    return 1;
+                }
+
+                PageSize = size;
+                break;
+            }
+            case 'x':
+                ExtentBytes = parse_size(optarg);
+
+                if (ExtentBytes < 0)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'X':
+                Promote = atof(optarg);
+
+                if (Promote < 0 || Promote > 1)
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'D':
+                if (!strcmp(optarg, "fault"))
+                {
+                    DirtyTracking = DIRTY_FAULT;
+                }
+                else if (!strcmp(optarg, "soft"))
+                {
+                    DirtyTracking = DIRTY_SOFT;
+                }
+                else if (!strcmp(optarg, "always"))
+                {
+                    DirtyTracking = DIRTY_ALWAYS;
+                }
+                else
+                {
+                    usage();
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (argc - optind != 4) 
+    {
+        usage();
+        return 1;
+    }
+
+    argv += optind - 1;
+
+    int npages = parse_count(argv[1], INT_MAX);
+    int nframes = parse_count(argv[2], PTE_MAX_FRAMES);
+
+    if (npages < 0)
+    {
+        fprintf(stderr,"the page count must be a number up to %d\n",INT_MAX);
+        return 1;
+    }
+
+    if (nframes < 0)
+    {
+        fprintf(stderr,"the frame count must be a number up to %d\n",PTE_MAX_FRAMES);
+        return 1;
+    }
+
+    /* A built-in policy by name, or a policy plugin by path. */
+
+#ifdef VIRTMEM_POLICY
+    if (strcmp(argv[3], Policy->name))
+    {
+        fprintf(stderr,"this virtmem is built for the %s policy only\n",Policy->name);
+        return 1;
+    }
+#else
+    Policy = policy_find(argv[3]);
+
+    if (!Policy)
+    {
+        return 1;
+    }
+#endif
+
+    setup_frame_array(nframes);
+
+    /* One tenant per program named. */
+
+    for (char *program = strtok(argv[4], ","); program; program = strtok(NULL, ","))
+    {
+        char *arg = strchr(program, ':');
+        const Program *p;
+
+        if (arg)
+        {
+            *arg++ = 0;
+        }
+
+        if (!(p = find_program(program)))
+        {
+            fprintf(stderr,"unknown program: %s\n",program);
+            return 1;
+        }
+
+        if (arg && !p->runWith)
+        {
+            fprintf(stderr,"%s takes no argument\n",program);
+            return 1;
+        }
+
+        double param = arg ? atof(arg) : p->param;
+
+        if (arg && (param < p->min || param > p->max))
+        {
+            fprintf(stderr,"%s needs an argument between %g and %g\n",program,p->min,p->max);
+            return 1;
+        }
+
+        if (TotalTenants == MAX_TENANTS)
+        {
+            fprintf(stderr,"at most %d programs can run at once\n",MAX_TENANTS);
+            return 1;
+        }
+
+        Tenants[TotalTenants].id = TotalTenants;
+        Tenants[TotalTenants].program = program;
+        Tenants[TotalTenants].param = param;
+        TotalTenants++;
+    }
+
+    if (npages < 3) 
+    {
+        printf("Your page count is too small. The minimum number of page required is 3.\n");
+        return 1;
+    }
+
+    if (nframes < 3) 
+    {
+        printf("Your frame count is too small. The minimum number of frames required is 3.\n");
+        return 1;
+    }
+
+    if (LocalReplacement && nframes < TotalTenants)
+    {
+        printf("Local replacement needs at least one frame per program.\n");
+        return 1;
+    }
+
+    /* An extent has to fit a few times over in the frames it is loaded into. */
+
+    if (ExtentBytes)
+    {
+        int share = LocalReplacement ? nframes / TotalTenants : nframes;
+
+        if (ExtentBytes % PageSize)
+        {
+            fprintf(stderr,"the extent size must be a multiple of the page size\n");
+            return 1;
+        }
+
+        if (ExtentBytes / PageSize > EXTENT_MAX_PAGES || ExtentBytes / PageSize > share / 4)
+        {
+            fprintf(stderr,"an extent can be at most %d pages, and a quarter of the frames\n",EXTENT_MAX_PAGES);
+            return 1;
+        }
+
+        ExtentPages = ExtentBytes / PageSize;
+        ExtentFrameBudget = share / 4;
+
+        /* The faulting page is never resident, so at most ExtentPages - 1 can be. */
+
+        PromoteThreshold = (int)ceil(Promote * ExtentPages);
+
+        if (PromoteThreshold > ExtentPages - 1)
+        {
+            PromoteThreshold = ExtentPages - 1;
+        }
+    }
+
+    if (Trials > 1)
+    {
+        if (SnapshotFile)
+        {
+            fprintf(stderr,"trials would share the warm start snapshot, leave out --warm\n");
+            return 1;
+        }
+
+        if (run_trials() < 0)
+        {
+            return 1;
+        }
+
+        if (TrialPipe < 0)
+        {
+            return 0;
+        }
+    }
+
+    if (Stripes > 0)
+    {
+        disk = disk_open_striped(StripeFiles, Stripes, StripeBlocks, (long)npages*TotalTenants, PageSize, DiskFlags);
+    }
+    else
+    {
+        disk = disk_open_sized("myvirtualdisk",(long)npages*TotalTenants,PageSize,DiskFlags);
+    }
+
+    if (!disk) 
+    {
+        fprintf(stderr,"couldn't create virtual disk: %s\n",strerror(errno));
+        return 1;
+    }
+
+    if (ModelName)
+    {
+        model = device_model_create(ModelName, PageSize);
+
+        if (!model)
+        {
+            fprintf(stderr,"unknown device model: %s\n",ModelName);
+            return 1;
+        }
+
+        disk_set_model(disk, model);
+    }
+
+    if (Policy->init && Policy->init(nframes, Seed, &PolicyState) < 0)
+    {
+        fprintf(stderr,"couldn't set up policy %s\n",Policy->name);
+        return 1;
+    }
+
+    /* Soft-dirty needs kernel support and a single faulting thread. */
+
+    if (DirtyTracking == DIRTY_SOFT)
+    {
+        if (TotalTenants > 1 || strstr(Tenants[0].program, "-mt"))
+        {
+            fprintf(stderr,"soft-dirty tracking needs one single-threaded program, treating every evicted page as dirty\n");
+            DirtyTracking = DIRTY_ALWAYS;
+        }
+        else if (!page_table_soft_dirty_supported())
+        {
+            fprintf(stderr,"this kernel has no soft-dirty bits, treating every evicted page as dirty\n");
+            DirtyTracking = DIRTY_ALWAYS;
+        }
+        else
+        {
+            FrameDirty = calloc(nframes, sizeof(char));
+            FrameFresh = calloc(nframes, sizeof(char));
+            HarvestInterval = nframes / 4 > 1 ? nframes / 4 : 1;
+        }
+    }
+
+    struct frame_pool *pool = frame_pool_create_size(nframes, PageSize);
+
+    if(!pool) 
+    {
+        fprintf(stderr,"couldn't create physical memory: %s\n",strerror(errno));
+        return 1;
+    }
+
+    FrameworkSetup(pool);
+
+    /* Split the frames between tenants, or let them share all of them. */
+
+    FrameRange *ranges = calloc(TotalTenants, sizeof(FrameRange));
+
+    for (int i = 0; i < TotalTenants; i++)
+    {
+        Tenant *t = &Tenants[i];
+
+        if (LocalReplacement)
+        {
+            ranges[i].first = nframes * i / TotalTenants;
+            ranges[i].count = nframes * (i + 1) / TotalTenants - ranges[i].first;
+            t->frames = &ranges[i];
+        }
+        else
+        {
+            ranges[0].count = nframes;
+            t->frames = &ranges[0];
+        }
+
+        t->firstBlock = (long)npages * i;
+        t->pt = page_table_create_in_pool(pool, npages, fault_handler, PageTableFlags);
+
+        if(!t->pt) 
+        {
+            fprintf(stderr,"couldn't create page table: %s\n",strerror(errno));
+            return 1;
+        }
+
+        page_table_set_data(t->pt, t);
+
+        if (ExtentPages > 1)
+        {
+            t->extentResident = calloc((npages + ExtentPages - 1) / ExtentPages, sizeof(int));
+        }
+    }
+
+    if (ExtentPages > 1)
+    {
+        Prefetched = calloc(nframes, sizeof(char));
+    }
+
+    int nranges = LocalReplacement ? TotalTenants : 1;
+
+    if (SnapshotFile)
+    {
+        int reads;
+        int loaded = load_snapshot(SnapshotFile, ranges, nranges, npages, nframes, &reads);
+
+        if (loaded >= 0)
+        {
+            printf("Warm start: %d pages in %d reads\n", loaded, reads);
+        }
+    }
+
+    /* A lone program runs on the main thread, several run side by side. */
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (TotalTenants == 1)
+    {
+        run_tenant(&Tenants[0]);
+    }
+    else
+    {
+        for (int i = 0; i < TotalTenants; i++)
+        {
+            pthread_create(&Tenants[i].thread, NULL, run_tenant, &Tenants[i]);
+        }
+
+        for (int i = 0; i < TotalTenants; i++)
+        {
+            pthread_join(Tenants[i].thread, NULL);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wallTime = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    /* Modeled time is 0 when no device model was asked for. */
+
+    double modeledTime = model ? device_model_time(model) : 0;
+
+    printf("\nFrames: %d, Pages: %d, Faults: %d, Reads: %d, Writes: %d, ModeledTime: %.6f, WallTime: %.6f\n", nframes, npages, Faults, Reads, Writes, modeledTime, wallTime);
+
+    if (Policy->stats)
+    {
+        Policy->stats(PolicyState, stdout);
+    }
+
+    /*
+     * Bytes moved, and with extents the bytes loaded that were never
+     * touched.  Untouched bytes inside a page cannot be seen, so there
+     * is no waste figure without extents.
+     */
+
+    if (ExtentPages > 1)
+    {
+        for (int frame = 0; frame < nframes; frame++)
+        {
+            WastedBytes += Prefetched[frame] ? PageSize : 0;
+        }
+
+        printf("PageSize: %d, IOBytes: %ld, WastedBytes: %ld, Promotions: %d, PrefetchHits: %d\n",
+               PageSize, ReadBytes + WriteBytes, WastedBytes, Promotions, PrefetchHits);
+    }
+    else if (PageSize != PAGE_SIZE)
+    {
+        printf("PageSize: %d, IOBytes: %ld\n", PageSize, ReadBytes + WriteBytes);
+    }
+
+    if (PageTableFlags & PAGE_TABLE_SPARSE)
+    {
+        size_t bytes = 0;
+
+        for (int i = 0; i < TotalTenants; i++)
+        {
+            bytes += page_table_get_memory(Tenants[i].pt);
+        }
+
+        printf("Page table memory: %zu bytes\n", bytes);
+    }
+
+    if (TotalTenants == 1)
+    {
+        char outputFile[256];
+        snprintf(outputFile, sizeof(outputFile), "%s_results.csv", Tenants[0].program);
+
+        Output = open_results(outputFile, "Frames,Pages,Faults,Reads,Writes,ModeledTime");
+
+        if (NULL != Output)
+        {
+            fprintf(Output, "%d, %d, %d, %d, %d, %.6f\n", nframes, npages, Faults, Reads, Writes, modeledTime);
+            fclose(Output);
+        }
+    }
+    else
+    {
+        Output = open_results("tenants_results.csv", "Tenant,Program,Replacement,Frames,Pages,Faults,Reads,Writes,Resident,PeakResident");
+
+        for (int i = 0; i < TotalTenants; i++)
+        {
+            Tenant *t = &Tenants[i];
+            const char *replacement = LocalReplacement ? "local" : "global";
+
+            printf("Tenant %d (%s): Faults: %d, Reads: %d, Writes: %d, Resident: %d, PeakResident: %d\n",
+                   t->id, t->program, t->faults, t->reads, t->writes, t->resident, t->peakResident);
+
+            if (NULL != Output)
+            {
+                fprintf(Output, "%d, %s, %s, %d, %d, %d, %d, %d, %d, %d\n",
+                        t->id, t->program, replacement, nframes, npages,
+                        t->faults, t->reads, t->writes, t->resident, t->peakResident);
+            }
+        }
+
+        if (NULL != Output)
+        {
+            fclose(Output);
+        }
+    }
+
+    if (SnapshotFile && save_snapshot(SnapshotFile, ranges, nranges, npages, nframes) < 0)
+    {
+        fprintf(stderr,"couldn't save snapshot %s: %s\n",SnapshotFile,strerror(errno));
+    }
+
+    /* Per-stripe throughput, once every queued write has landed. */
+
+    disk_sync(disk);
+
+    for (int i = 0; i < disk_nstripes(disk); i++)
+    {
+        struct disk_stripe_stats stats;
+        disk_get_stripe_stats(disk, i, &stats);
+
+        double mb = (double)(stats.reads + stats.writes) * PageSize / (1024 * 1024);
+
+        printf("Stripe %d (%s): Reads: %ld, Writes: %ld, Busy: %.6fs, Throughput: %.1f MB/s\n",
+               i, StripeFiles[i], stats.reads, stats.writes, stats.busy,
+               stats.busy > 0 ? mb / stats.busy : 0);
+    }
+
+    for (int i = 0; i < TotalTenants; i++)
+    {
+        page_table_delete(Tenants[i].pt);
+        free(Tenants[i].extentResident);
+    }
+
+    free(Prefetched);
+
+    frame_pool_delete(pool);
+    free(ranges);
+
+    if (Policy->destroy)
+    {
+        Policy->destroy(PolicyState);
+    }
+
+    disk_close(disk);
+
+    if (model)
+    {
+        device_model_delete(model);
+    }
+
+    if (TrialPipe >= 0)
+    {
+        int counts[3] = { Faults, Reads, Writes };
+
+        if (write(TrialPipe, counts, sizeof(counts)) != sizeof(counts))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Sets up int array of frame numbers
+ * based on a based capacity.
+ * Initializes all indices to -1
+ */
+ 
+void setup_frame_array(int cap)
+{
+    FrameArray = (long *)malloc(cap * sizeof(long));
+
+    for (unsigned i = 0; i < cap; i++)
+    {
+        FrameArray[i] = -1;
+    }
 }
 
 /*
  * Establishes some of the important globals for
- * the random and custom algorithms
+ * the fault handler and eviction policies
  */
 
-void FrameworkSetup(struct page_table *pt)
+void FrameworkSetup(struct frame_pool *pool)
 {
-    TotalPages = page_table_get_npages(pt);
-    TotalFrames = page_table_get_nframes(pt);
-    physmem = page_table_get_physmem(pt);
+    physmem = pool->physmem;
 }
@@ -4,6 +4,8 @@ Do not modify this file.
 Make all of your changes to main.c instead.
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -12,6 +14,10 @@ Make all of your changes to main.c instead.
 #include <fcntl.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
 
 #include "page_table.h"
 
@@ -19,7 +25,28 @@ Make all of your changes to main.c instead.
 int remap_file_pages(void *addr, size_t size, int prot,
                             size_t pgoff, int flags);
 
-struct page_table *the_page_table = 0;
+/*
+Every live page table, so that a fault can be routed to the one whose
+virtual memory contains it.  The list is only changed under
+page_tables_lock; the signal handler walks it without the lock.
+*/
+
+static struct page_table *page_tables = 0;
+static pthread_mutex_t page_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+A build may name its one fault handler in PAGE_TABLE_HANDLER, so that
+faults on the page tables using it call it directly instead of through
+the handler pointer, and with link-time optimization can inline it.
+*/
+
+#ifdef PAGE_TABLE_HANDLER
+void PAGE_TABLE_HANDLER( struct page_table *pt, int page );
+#endif
+
+/* Whether the fault the handler on this thread is serving was a write. */
+
+static __thread int fault_write = 1;
 
 static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 {
@@ -30,12 +57,23 @@ static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 	char *addr = info->si_addr;
 #endif
 
-	struct page_table *pt = the_page_table;
+	/* Bit 1 of the x86-64 page fault error code is set for writes. */
+
+#if defined(__x86_64__) && defined(REG_ERR)
+	fault_write = (((ucontext_t *)context)->uc_mcontext.gregs[REG_ERR]&2) != 0;
+#endif
 
-	if(pt) {
-		int page = (addr-pt->virtmem) / PAGE_SIZE;
+	struct page_table *pt;
 
-		if(page>=0 && page<pt->npages) {
+	for(pt=__atomic_load_n(&page_tables,__ATOMIC_ACQUIRE);pt;pt=pt->next) {
+		if(addr>=pt->virtmem && addr<pt->virtmem+(size_t)pt->npages*pt->page_size) {
+			int page = (addr-pt->virtmem) / pt->page_size;
+#ifdef PAGE_TABLE_HANDLER
+			if(pt->handler==PAGE_TABLE_HANDLER) {
+				PAGE_TABLE_HANDLER(pt,page);
+				return;
+			}
+#endif
 			pt->handler(pt,page);
 			return;
 		}
@@ -45,39 +83,169 @@ static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 	abort();
 }
 
+/*
+Leaves of a sparse page table are carved out of arenas obtained with
+mmap, which is safe to call from the fault handler where malloc is not.
+The first leaf-sized slot of each arena links it to the previous one.
+*/
+
+#define LEAF_BYTES        (PTE_LEAF_ENTRIES*sizeof(pte_t))
+#define LEAF_ARENA_LEAVES 64
+#define LEAF_ARENA_BYTES  (LEAF_BYTES*(LEAF_ARENA_LEAVES+1))
+
+pte_t * page_table_make_leaf( struct page_table *pt, int page )
+{
+	pte_t **slot = &pt->leaves[page>>PTE_LEAF_SHIFT];
+	pte_t *leaf;
+
+	pthread_mutex_lock(&pt->leaf_lock);
+
+	leaf = *slot;
+	if(!leaf) {
+		if(!pt->leaf_arena_free) {
+			char *arena = mmap(0,LEAF_ARENA_BYTES,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+			if(arena==MAP_FAILED) {
+				fprintf(stderr,"page table: out of memory for page #%d\n",page);
+				abort();
+			}
+			*(char**)arena = pt->leaf_arena;
+			pt->leaf_arena = arena;
+			pt->leaf_arena_free = LEAF_ARENA_LEAVES;
+		}
+
+		leaf = (pte_t*)(pt->leaf_arena + LEAF_BYTES*(LEAF_ARENA_LEAVES-pt->leaf_arena_free+1));
+		pt->leaf_arena_free--;
+		pt->nleaves++;
+
+		__atomic_store_n(slot,leaf,__ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&pt->leaf_lock);
+
+	return &leaf[page&(PTE_LEAF_ENTRIES-1)];
+}
+
+struct frame_pool * frame_pool_create( int nframes )
+{
+	return frame_pool_create_size(nframes,PAGE_SIZE);
+}
+
+struct frame_pool * frame_pool_create_size( int nframes, int page_size )
+{
+	struct frame_pool *pool;
+	char filename[256];
+	static int count = 0;
+
+	if(nframes<1 || nframes>PTE_MAX_FRAMES) return 0;
+	if(page_size<sysconf(_SC_PAGESIZE) || page_size>PAGE_SIZE_MAX || (page_size&(page_size-1))) return 0;
+
+	pool = malloc(sizeof(struct frame_pool));
+	if(!pool) return 0;
+
+	sprintf(filename,"/tmp/pmem.%d.%d.%d",getpid(),getuid(),__atomic_fetch_add(&count,1,__ATOMIC_RELAXED));
+
+	pool->fd = open(filename,O_CREAT|O_TRUNC|O_RDWR,0777);
+	if(pool->fd<0) {
+		free(pool);
+		return 0;
+	}
+
+	unlink(filename);
+
+	if(ftruncate(pool->fd,(off_t)page_size*nframes)<0) {
+		close(pool->fd);
+		free(pool);
+		return 0;
+	}
+
+	pool->physmem = mmap(0,(size_t)nframes*page_size,PROT_READ|PROT_WRITE,MAP_SHARED,pool->fd,0);
+	if(pool->physmem==MAP_FAILED) {
+		close(pool->fd);
+		free(pool);
+		return 0;
+	}
+
+	pool->nframes = nframes;
+	pool->page_size = page_size;
+
+	return pool;
+}
+
+void frame_pool_delete( struct frame_pool *pool )
+{
+	munmap(pool->physmem,(size_t)pool->nframes*pool->page_size);
+	close(pool->fd);
+	free(pool);
+}
+
 struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler )
 {
-	int i;
-	struct sigaction sa;
+	struct frame_pool *pool;
 	struct page_table *pt;
-	char filename[256];
 
-	pt = malloc(sizeof(struct page_table));
-	if(!pt) return 0;
+	pool = frame_pool_create(nframes);
+	if(!pool) return 0;
 
-	the_page_table = pt;
+	pt = page_table_create_in_pool(pool,npages,handler,0);
+	if(!pt) {
+		frame_pool_delete(pool);
+		return 0;
+	}
 
-	sprintf(filename,"/tmp/pmem.%d.%d",getpid(),getuid());
+	pt->owns_pool = 1;
 
-	pt->fd = open(filename,O_CREAT|O_TRUNC|O_RDWR,0777);
-	if(!pt->fd) return 0;
+	return pt;
+}
 
-	ftruncate(pt->fd,PAGE_SIZE*npages);
+struct page_table * page_table_create_in_pool( struct frame_pool *pool, int npages, page_fault_handler_t handler, int flags )
+{
+	struct sigaction sa;
+	struct page_table *pt;
 
-	unlink(filename);
+	pt = malloc(sizeof(struct page_table));
+	if(!pt) return 0;
+
+	pt->pool = pool;
+	pt->owns_pool = 0;
+	pt->data = 0;
 
-	pt->physmem = mmap(0,nframes*PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,pt->fd,0);
-	pt->nframes = nframes;
+	pt->fd = pool->fd;
+	pt->physmem = pool->physmem;
+	pt->nframes = pool->nframes;
+	pt->page_size = pool->page_size;
 
-	pt->virtmem = mmap(0,npages*PAGE_SIZE,PROT_NONE,MAP_SHARED|MAP_NORESERVE,pt->fd,0);
+	pt->virtmem = mmap(0,(size_t)npages*pt->page_size,PROT_NONE,MAP_SHARED|MAP_NORESERVE,pt->fd,0);
+	if(pt->virtmem==MAP_FAILED) {
+		free(pt);
+		return 0;
+	}
 	pt->npages = npages;
 
-	pt->page_bits = malloc(sizeof(int)*npages);
-	pt->page_mapping = malloc(sizeof(int)*npages);
+	pt->entries = 0;
+	pt->leaves = 0;
+	pt->leaf_arena = 0;
+	pt->leaf_arena_free = 0;
+	pt->nleaves = 0;
+	pthread_mutex_init(&pt->leaf_lock,0);
+
+	if(flags&PAGE_TABLE_SPARSE) {
+		pt->leaves = calloc(((size_t)npages+PTE_LEAF_ENTRIES-1)/PTE_LEAF_ENTRIES,sizeof(pte_t*));
+	} else {
+		pt->entries = calloc(npages,sizeof(pte_t));
+	}
+
+	if(!pt->entries && !pt->leaves) {
+		munmap(pt->virtmem,(size_t)npages*pt->page_size);
+		free(pt);
+		return 0;
+	}
 
 	pt->handler = handler;
 
-	for(i=0;i<pt->npages;i++) pt->page_bits[i] = 0;
+	pthread_mutex_lock(&page_tables_lock);
+	pt->next = page_tables;
+	__atomic_store_n(&page_tables,pt,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&page_tables_lock);
 
 	sa.sa_sigaction = internal_fault_handler;
 	sa.sa_flags = SA_SIGINFO;
@@ -90,56 +258,123 @@ struct page_table * page_table_create( int npages, int nframes, page_fault_handl
 
 void page_table_delete( struct page_table *pt )
 {
-	munmap(pt->virtmem,pt->npages*PAGE_SIZE);
-	munmap(pt->physmem,pt->nframes*PAGE_SIZE);
-	free(pt->page_bits);
-	free(pt->page_mapping);
-	close(pt->fd);
+	struct page_table **p;
+
+	pthread_mutex_lock(&page_tables_lock);
+	for(p=&page_tables;*p;p=&(*p)->next) {
+		if(*p==pt) {
+			*p = pt->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&page_tables_lock);
+
+	munmap(pt->virtmem,(size_t)pt->npages*pt->page_size);
+	free(pt->entries);
+	free(pt->leaves);
+	while(pt->leaf_arena) {
+		char *next = *(char**)pt->leaf_arena;
+		munmap(pt->leaf_arena,LEAF_ARENA_BYTES);
+		pt->leaf_arena = next;
+	}
+	pthread_mutex_destroy(&pt->leaf_lock);
+	if(pt->owns_pool) frame_pool_delete(pt->pool);
 	free(pt);
 }
 
+int page_table_fault_is_write( void )
+{
+	return fault_write;
+}
+
+void page_table_bad_page( const char *func, int page )
+{
+	fprintf(stderr,"%s: illegal page #%d\n",func,page);
+	abort();
+}
+
 void page_table_set_entry( struct page_table *pt, int page, int frame, int bits )
 {
-	if( page<0 || page>=pt->npages ) {
-		fprintf(stderr,"page_table_set_entry: illegal page #%d\n",page);
-		abort();
-	}
+	page_table_check_page(pt,page,"page_table_set_entry");
 
+#ifndef NDEBUG
 	if( frame<0 || frame>=pt->nframes ) {
 		fprintf(stderr,"page_table_set_entry: illegal frame #%d\n",frame);
 		abort();
 	}
+#endif
+
+	/* Keep the state and waiter bits, which other threads may change. */
 
-	pt->page_mapping[page] = frame;
-	pt->page_bits[page] = bits;
+	pte_t *word = page_table_entry(pt,page);
+	pte_t old = __atomic_load_n(word,__ATOMIC_RELAXED);
+	pte_t new;
 
-	remap_file_pages(pt->virtmem+page*PAGE_SIZE,PAGE_SIZE,0,frame,0);
-	mprotect(pt->virtmem+page*PAGE_SIZE,PAGE_SIZE,bits);
+	do {
+		new = (old&(PTE_STATE_MASK|PTE_WAITERS)) | ((pte_t)frame<<PTE_FRAME_SHIFT) | (bits&PTE_BITS_MASK);
+	} while(!__atomic_compare_exchange_n(word,&old,new,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+
+	/* remap_file_pages counts file offsets in host pages. */
+
+	remap_file_pages(pt->virtmem+(size_t)page*pt->page_size,pt->page_size,0,(size_t)frame*(pt->page_size/sysconf(_SC_PAGESIZE)),0);
+	mprotect(pt->virtmem+(size_t)page*pt->page_size,pt->page_size,bits);
 }
 
-void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits )
+void page_table_set_bits( struct page_table *pt, int page, int bits )
 {
-	if( page<0 || page>=pt->npages ) {
-		fprintf(stderr,"page_table_get_entry: illegal page #%d\n",page);
-		abort();
+	page_table_check_page(pt,page,"page_table_set_bits");
+
+	pte_t *word = page_table_entry(pt,page);
+	pte_t old = __atomic_load_n(word,__ATOMIC_RELAXED);
+
+	while(!__atomic_compare_exchange_n(word,&old,(old&~PTE_BITS_MASK)|(bits&PTE_BITS_MASK),0,__ATOMIC_RELEASE,__ATOMIC_RELAXED)) {
 	}
 
-	*frame = pt->page_mapping[page];
-	*bits = pt->page_bits[page];
+	mprotect(pt->virtmem+(size_t)page*pt->page_size,pt->page_size,bits);
 }
 
-void page_table_print_entry( struct page_table *pt, int page )
+/*
+The futex wait queue of an entry is the list of threads waiting for
+its state to change.  PTE_WAITERS is set by a thread about to sleep,
+so page_table_set_state only pays for a wake-up system call when that
+list may be non-empty.
+*/
+
+void page_table_wake( pte_t *word )
 {
-	if( page<0 || page>=pt->npages ) {
-		fprintf(stderr,"page_table_print_entry: illegal page #%d\n",page);
-		abort();
+	syscall(SYS_futex,word,FUTEX_WAKE_PRIVATE,INT_MAX,0,0,0);
+}
+
+void page_table_wait_state( struct page_table *pt, int page, int state )
+{
+	page_table_check_page(pt,page,"page_table_wait_state");
+
+	pte_t *word = page_table_entry(pt,page);
+	pte_t current = __atomic_load_n(word,__ATOMIC_ACQUIRE);
+
+	while((current&PTE_STATE_MASK)==((pte_t)state<<PTE_STATE_SHIFT)) {
+		if(!(current&PTE_WAITERS)) {
+			if(!__atomic_compare_exchange_n(word,&current,current|PTE_WAITERS,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			current |= PTE_WAITERS;
+		}
+		syscall(SYS_futex,word,FUTEX_WAIT_PRIVATE,current,0,0,0);
+		current = __atomic_load_n(word,__ATOMIC_ACQUIRE);
 	}
+}
 
-	int b = pt->page_bits[page];
+void page_table_print_entry( struct page_table *pt, int page )
+{
+	int frame, b;
+
+	page_table_check_page(pt,page,"page_table_print_entry");
+
+	page_table_get_entry(pt,page,&frame,&b);
 
 	printf("page %06d: frame %06d bits %c%c%c\n",
 		page,
-		pt->page_mapping[page],
+		frame,
 		b&PROT_READ  ? 'r' : '-',
 		b&PROT_WRITE ? 'w' : '-',
 		b&PROT_EXEC  ? 'x' : '-'
@@ -155,22 +390,92 @@ void page_table_print( struct page_table *pt )
 	}
 }
 
-int page_table_get_nframes( struct page_table *pt )
+/*
+Bit 55 of a pagemap entry is the soft-dirty bit.  Entries are indexed
+by the host's page size, which need not be the page table's; a large
+page is soft-dirty if any host page in it is.
+*/
+
+#define PAGEMAP_SOFT_DIRTY (1ULL<<55)
+
+static int pagemap_fd = -1;
+static long host_page_size = 0;
+
+static int read_soft_dirty( void *addr, size_t length )
 {
-	return pt->nframes;
+	uint64_t entries[64];
+	size_t n = length/host_page_size;
+	off_t offset = (off_t)((uintptr_t)addr/host_page_size)*sizeof(uint64_t);
+
+	while(n>0) {
+		size_t chunk = n<64 ? n : 64;
+		size_t i;
+
+		if(pread(pagemap_fd,entries,chunk*sizeof(uint64_t),offset)!=chunk*sizeof(uint64_t)) return -1;
+
+		for(i=0;i<chunk;i++) {
+			if(entries[i]&PAGEMAP_SOFT_DIRTY) return 1;
+		}
+
+		n -= chunk;
+		offset += chunk*sizeof(uint64_t);
+	}
+
+	return 0;
 }
 
-int page_table_get_npages( struct page_table *pt )
+void page_table_clear_soft_dirty( void )
 {
-	return pt->npages;
+	int fd = open("/proc/self/clear_refs",O_WRONLY);
+
+	if(fd>=0) {
+		if(write(fd,"4",1)!=1) {
+			perror("page_table_clear_soft_dirty");
+		}
+		close(fd);
+	}
+}
+
+/*
+The bits are only trusted if a scratch page is seen to lose its bit
+on a clear and to get it back when written.
+*/
+
+int page_table_soft_dirty_supported( void )
+{
+	volatile char *scratch;
+	int supported;
+
+	if(pagemap_fd<0) {
+		host_page_size = sysconf(_SC_PAGESIZE);
+		pagemap_fd = open("/proc/self/pagemap",O_RDONLY);
+		if(pagemap_fd<0) return 0;
+	}
+
+	scratch = mmap(0,host_page_size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	if(scratch==MAP_FAILED) return 0;
+
+	scratch[0] = 1;
+	page_table_clear_soft_dirty();
+	supported = read_soft_dirty((void*)scratch,host_page_size)==0;
+	scratch[0] = 2;
+	supported = supported && read_soft_dirty((void*)scratch,host_page_size)==1;
+
+	munmap((void*)scratch,host_page_size);
+
+	return supported;
 }
 
-char * page_table_get_virtmem( struct page_table *pt )
+int page_table_get_soft_dirty( struct page_table *pt, int page )
 {
-	return pt->virtmem;
+	page_table_check_page(pt,page,"page_table_get_soft_dirty");
+
+	return read_soft_dirty(pt->virtmem+(size_t)page*pt->page_size,pt->page_size);
 }
 
-char * page_table_get_physmem( struct page_table *pt )
+size_t page_table_get_memory( struct page_table *pt )
 {
-	return pt->physmem;
+	if(pt->entries) return (size_t)pt->npages*sizeof(pte_t);
+
+	return ((size_t)pt->npages+PTE_LEAF_ENTRIES-1)/PTE_LEAF_ENTRIES*sizeof(pte_t*) + (size_t)pt->nleaves*LEAF_BYTES;
 }
@@ -2,36 +2,152 @@
 #define PAGE_TABLE_H
 
 #include <sys/mman.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+PAGE_SIZE is the page size of page tables in a pool made by
+frame_pool_create.  frame_pool_create_size allows any power of two
+from the host's page size up to PAGE_SIZE_MAX.
+*/
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
 #endif
 
+#define PAGE_SIZE_MAX (2*1024*1024)
+
 struct page_table;
+struct frame_pool;
 
 typedef void (*page_fault_handler_t) ( struct page_table *pt, int page );
 
+/*
+Residency state of a page.  Several threads may fault at once, each
+running the handler on its own stack, so a handler claims a page by
+moving it out of PAGE_UNMAPPED or PAGE_RESIDENT with page_table_try_state
+and releases it with page_table_set_state.  While a page is
+PAGE_LOADING or PAGE_EVICTING its entry belongs to the thread that
+claimed it, and other threads wait with page_table_wait_state.
+*/
+
+#define PAGE_UNMAPPED 0
+#define PAGE_LOADING  1
+#define PAGE_RESIDENT 2
+#define PAGE_EVICTING 3
+
+/*
+A page table entry is packed into one 32-bit word:
+  bits 0-2   access bits: PROT_READ, PROT_WRITE, PROT_EXEC
+  bits 3-4   residency state
+  bit  5     set while a thread is waiting for the state to change
+  bits 8-31  frame number
+so an entry is read, and its state changed, with single atomic
+operations, and the word doubles as the futex that waiters sleep on.
+*/
+
+typedef uint32_t pte_t;
+
+#define PTE_BITS_MASK   0x7
+#define PTE_STATE_SHIFT 3
+#define PTE_STATE_MASK  (0x3<<PTE_STATE_SHIFT)
+#define PTE_WAITERS     0x20
+#define PTE_FRAME_SHIFT 8
+#define PTE_MAX_FRAMES  (1<<(32-PTE_FRAME_SHIFT))
+
+/*
+Flags for page_table_create_in_pool.
+PAGE_TABLE_SPARSE keeps the entries in a two-level table: a directory
+of pointers to leaves of PTE_LEAF_ENTRIES entries each.  A leaf is
+only allocated the first time one of its pages is mapped, so creating
+the table takes the same time however big "npages" is, and a huge,
+sparsely touched virtual memory costs page table memory only for the
+regions actually used.  Lookups stay two array indexings.
+*/
+
+#define PAGE_TABLE_SPARSE 1
+
+#define PTE_LEAF_SHIFT   10
+#define PTE_LEAF_ENTRIES (1<<PTE_LEAF_SHIFT)
+
+/*
+A frame pool is a physical memory that several page tables can map
+their pages into, so that they compete for the same frames.
+*/
+
+struct frame_pool {
+	int fd;
+	char *physmem;
+	int nframes;
+	int page_size;
+};
+
 struct page_table {
 	int fd;
 	char *virtmem;
 	int npages;
 	char *physmem;
 	int nframes;
-	int *page_mapping;
-	int *page_bits;
+	int page_size;
+	pte_t *entries;
+	pte_t **leaves;
+	char *leaf_arena;
+	int leaf_arena_free;
+	long nleaves;
+	pthread_mutex_t leaf_lock;
 	page_fault_handler_t handler;
+	struct frame_pool *pool;
+	int owns_pool;
+	void *data;
+	struct page_table *next;
 };
 
+/*
+Create a physical memory of "nframes" frames to be shared by page tables.
+"nframes" may be at most PTE_MAX_FRAMES.
+*/
+
+struct frame_pool * frame_pool_create( int nframes );
+
+/*
+Like frame_pool_create, with frames of "page_size" bytes instead of
+PAGE_SIZE.  Every page table in the pool has pages of that size.
+*/
+
+struct frame_pool * frame_pool_create_size( int nframes, int page_size );
+
+/* Delete a frame pool.  Every page table using it must be deleted first. */
+
+void frame_pool_delete( struct frame_pool *pool );
+
 /* Create a new page table, along with a corresponding virtual memory
 that is "npages" big and a physical memory that is "nframes" bit
  When a page fault occurs, the routine pointed to by "handler" will be called. */
 
 struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler );
 
-/* Delete a page table and the corresponding virtual and physical memories. */
+/*
+Create a new page table with a virtual memory "npages" big, whose pages
+are mapped into the frames of "pool".  Any number of page tables may
+exist at once; a fault is delivered to the handler of the page table
+whose virtual memory contains the faulting address.
+"flags" is 0 or PAGE_TABLE_SPARSE.
+*/
+
+struct page_table * page_table_create_in_pool( struct frame_pool *pool, int npages, page_fault_handler_t handler, int flags );
+
+/* Delete a page table and its virtual memory, and its physical memory unless that is a shared pool. */
 
 void page_table_delete( struct page_table *pt );
 
+/* Attach an arbitrary pointer to a page table, for use by its fault handler. */
+
+static inline void page_table_set_data( struct page_table *pt, void *data );
+
+/* Return the pointer attached with page_table_set_data, or null. */
+
+static inline void * page_table_get_data( struct page_table *pt );
+
 /*
 Set the frame number and access bits associated with a page.
 The bits may be any of PROT_READ, PROT_WRITE, or PROT_EXEC logical-ored together.
@@ -45,23 +161,80 @@ Get the frame number and access bits associated with a page.
 The bits may be any of PROT_READ, PROT_WRITE, or PROT_EXEC logical-ored together.
 */
 
-void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits );
+static inline void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits );
+
+/*
+Change the access bits of a mapped page without remapping it.
+The bits are as for page_table_set_entry.
+*/
+
+void page_table_set_bits( struct page_table *pt, int page, int bits );
+
+/* Return the residency state of a page. */
+
+static inline int page_table_get_state( struct page_table *pt, int page );
+
+/*
+Atomically move a page from state "from" to state "to".
+Returns nonzero if the page was in state "from", and zero otherwise.
+*/
+
+static inline int page_table_try_state( struct page_table *pt, int page, int from, int to );
+
+/* Put a page in state "state", waking every thread waiting on it. */
+
+static inline void page_table_set_state( struct page_table *pt, int page, int state );
+
+/* Block for as long as a page stays in state "state". */
+
+void page_table_wait_state( struct page_table *pt, int page, int state );
+
+/*
+Called from a fault handler, returns nonzero if the fault was a write
+and zero if it was a read.  Where the hardware does not say, every
+fault counts as a write.
+*/
+
+int page_table_fault_is_write( void );
+
+/*
+Soft-dirty tracking.  Where the kernel supports it, every write to a
+page sets the page's soft-dirty bit in /proc/self/pagemap, with no
+fault delivered to the process, and page_table_clear_soft_dirty clears
+the bit of every page of the process at once.  Mapping a page with
+page_table_set_entry also sets its bit, until the next clear.
+
+page_table_soft_dirty_supported returns nonzero if the bits work here.
+page_table_get_soft_dirty returns the bit of a page, or -1 on error.
+*/
+
+int page_table_soft_dirty_supported( void );
+int page_table_get_soft_dirty( struct page_table *pt, int page );
+void page_table_clear_soft_dirty( void );
+
+/* Return the number of bytes of memory holding the entries of a page table. */
+
+size_t page_table_get_memory( struct page_table *pt );
 
 /* Return a pointer to the start of the virtual memory associated with a page table. */
 
-char * page_table_get_virtmem( struct page_table *pt );
+static inline char * page_table_get_virtmem( struct page_table *pt );
 
 /* Return a pointer to the start of the physical memory associated with a page table. */
 
-char * page_table_get_physmem( struct page_table *pt );
+static inline char * page_table_get_physmem( struct page_table *pt );
 
 /* Return the total number of frames in the physical memory. */
 
-int page_table_get_nframes( struct page_table *pt );
+static inline int page_table_get_nframes( struct page_table *pt );
+
+/* Return the size in bytes of each page, and of each frame. */
+
+static inline int page_table_get_page_size( struct page_table *pt );
 
 /* Return the total number of pages in the virtual memory. */
 
-int page_table_get_npages( struct page_table *pt );
+static inline int page_table_get_npages( struct page_table *pt );
 
 /* Print out the page table entry for a single page. */
 
@@ -71,4 +244,132 @@ void page_table_print_entry( struct page_table *pt, int page );
 
 void page_table_print( struct page_table *pt );
 
+/*
+The accessors the fault path calls for every fault are defined here,
+so that they inline into the handler.  They use the helpers below,
+which are not meant to be called directly:
+page_table_make_leaf allocates the leaf of a sparse table that holds
+a page and returns the page's entry, page_table_wake wakes the threads
+waiting on an entry, and page_table_bad_page reports an illegal page
+and aborts.
+
+Every function taking a page checks that it is in range, unless the
+build defines NDEBUG.
+*/
+
+pte_t * page_table_make_leaf( struct page_table *pt, int page );
+void page_table_wake( pte_t *word );
+void page_table_bad_page( const char *func, int page ) __attribute__((noreturn));
+
+#ifdef NDEBUG
+#define page_table_check_page(pt,page,func) ((void)0)
+#else
+#define page_table_check_page(pt,page,func) \
+	((page)<0 || (page)>=(pt)->npages ? page_table_bad_page(func,page) : (void)0)
+#endif
+
+/* Return the entry of a page, allocating its leaf if need be. */
+
+static inline pte_t * page_table_entry( struct page_table *pt, int page )
+{
+	if(pt->entries) return &pt->entries[page];
+
+	pte_t *leaf = __atomic_load_n(&pt->leaves[page>>PTE_LEAF_SHIFT],__ATOMIC_ACQUIRE);
+
+	return leaf ? &leaf[page&(PTE_LEAF_ENTRIES-1)] : page_table_make_leaf(pt,page);
+}
+
+/* Return the value of the entry of a page, unmapped if its leaf does not exist yet. */
+
+static inline pte_t page_table_load_entry( struct page_table *pt, int page )
+{
+	if(pt->entries) return __atomic_load_n(&pt->entries[page],__ATOMIC_ACQUIRE);
+
+	pte_t *leaf = __atomic_load_n(&pt->leaves[page>>PTE_LEAF_SHIFT],__ATOMIC_ACQUIRE);
+
+	return leaf ? __atomic_load_n(&leaf[page&(PTE_LEAF_ENTRIES-1)],__ATOMIC_ACQUIRE) : 0;
+}
+
+static inline void page_table_set_data( struct page_table *pt, void *data )
+{
+	pt->data = data;
+}
+
+static inline void * page_table_get_data( struct page_table *pt )
+{
+	return pt->data;
+}
+
+static inline void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits )
+{
+	page_table_check_page(pt,page,"page_table_get_entry");
+
+	pte_t e = page_table_load_entry(pt,page);
+
+	*frame = e>>PTE_FRAME_SHIFT;
+	*bits = e&PTE_BITS_MASK;
+}
+
+static inline int page_table_get_state( struct page_table *pt, int page )
+{
+	page_table_check_page(pt,page,"page_table_get_state");
+
+	return (page_table_load_entry(pt,page)&PTE_STATE_MASK)>>PTE_STATE_SHIFT;
+}
+
+static inline int page_table_try_state( struct page_table *pt, int page, int from, int to )
+{
+	page_table_check_page(pt,page,"page_table_try_state");
+
+	pte_t *word = page_table_entry(pt,page);
+	pte_t old = __atomic_load_n(word,__ATOMIC_ACQUIRE);
+
+	while((old&PTE_STATE_MASK)==((pte_t)from<<PTE_STATE_SHIFT)) {
+		pte_t new = (old&~PTE_STATE_MASK) | ((pte_t)to<<PTE_STATE_SHIFT);
+		if(__atomic_compare_exchange_n(word,&old,new,0,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) return 1;
+	}
+
+	return 0;
+}
+
+static inline void page_table_set_state( struct page_table *pt, int page, int state )
+{
+	page_table_check_page(pt,page,"page_table_set_state");
+
+	pte_t *word = page_table_entry(pt,page);
+	pte_t old = __atomic_load_n(word,__ATOMIC_RELAXED);
+	pte_t new;
+
+	do {
+		new = (old&~(PTE_STATE_MASK|PTE_WAITERS)) | ((pte_t)state<<PTE_STATE_SHIFT);
+	} while(!__atomic_compare_exchange_n(word,&old,new,0,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED));
+
+	if(old&PTE_WAITERS) page_table_wake(word);
+}
+
+static inline char * page_table_get_virtmem( struct page_table *pt )
+{
+	return pt->virtmem;
+}
+
+static inline char * page_table_get_physmem( struct page_table *pt )
+{
+	return pt->physmem;
+}
+
+static inline int page_table_get_nframes( struct page_table *pt )
+{
+	return pt->nframes;
+}
+
+static inline int page_table_get_page_size( struct page_table *pt )
+{
+	return pt->page_size;
+}
+
+static inline int page_table_get_npages( struct page_table *pt )
+{
+	return pt->npages;
+}
+
 #endif
@@ -0,0 +1,677 @@
+#include "policy.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+/*
+FIFO.  Frames are filled in order and each incoming page takes the
+frame of the page it evicts, so the queue is simply the frames of the
+range in rotation.
+*/
+
+static int fifo_pick_victim( void *state, struct frame_range *range )
+{
+	return range->first + __atomic_fetch_add(&range->hand,1,__ATOMIC_RELAXED) % range->count;
+}
+
+const struct policy fifo_policy = {
+	.name = "fifo",
+	.pick_victim = fifo_pick_victim,
+};
+
+/* Random.  Chooses frames to evict purely randomly. */
+
+static int rand_init( int nframes, uint64_t seed, void **state )
+{
+	struct policy_random *r = malloc(sizeof(*r));
+	if(!r) return -1;
+
+	policy_random_seed(r,seed);
+	*state = r;
+	return 0;
+}
+
+static int rand_pick_victim( void *state, struct frame_range *range )
+{
+	return range->first + policy_random_below(state,range->count);
+}
+
+static void rand_destroy( void *state )
+{
+	free(state);
+}
+
+const struct policy rand_policy = {
+	.name = "rand",
+	.init = rand_init,
+	.pick_victim = rand_pick_victim,
+	.destroy = rand_destroy,
+};
+
+/*
+Custom, "second-try-random".  Random, but gives a second chance to
+any frame whose page has been written to:
+1. Select a random frame.
+2. If its second-chance mark is set, clear it and look again.
+3. If it is not set, evict that frame.
+*/
+
+struct custom_state {
+	struct policy_random random;
+	char *marks;
+	long second_chances;
+};
+
+static int custom_init( int nframes, uint64_t seed, void **state )
+{
+	struct custom_state *s = malloc(sizeof(*s));
+	if(!s) return -1;
+
+	s->marks = calloc(nframes,1);
+	if(!s->marks) {
+		free(s);
+		return -1;
+	}
+	s->second_chances = 0;
+
+	policy_random_seed(&s->random,seed);
+	*state = s;
+	return 0;
+}
+
+static void custom_on_access_upgrade( void *state, int frame )
+{
+	struct custom_state *s = state;
+	s->marks[frame] = 1;
+}
+
+/* A mark belongs to the page that earned it, not to the frame. */
+
+static void custom_on_fault( void *state, int frame, long key )
+{
+	struct custom_state *s = state;
+	__atomic_store_n(&s->marks[frame],0,__ATOMIC_RELAXED);
+}
+
+static void custom_on_evict( void *state, int frame, long key )
+{
+	struct custom_state *s = state;
+	__atomic_store_n(&s->marks[frame],0,__ATOMIC_RELAXED);
+}
+
+static int custom_pick_victim( void *state, struct frame_range *range )
+{
+	struct custom_state *s = state;
+
+	while(1) {
+		int frame = range->first + policy_random_below(&s->random,range->count);
+
+		if(!__atomic_exchange_n(&s->marks[frame],0,__ATOMIC_RELAXED)) return frame;
+
+		__atomic_fetch_add(&s->second_chances,1,__ATOMIC_RELAXED);
+	}
+}
+
+static void custom_stats( void *state, FILE *out )
+{
+	struct custom_state *s = state;
+	fprintf(out,"Second chances: %ld\n",s->second_chances);
+}
+
+static void custom_destroy( void *state )
+{
+	struct custom_state *s = state;
+	free(s->marks);
+	free(s);
+}
+
+const struct policy custom_policy = {
+	.name = "custom",
+	.init = custom_init,
+	.on_fault = custom_on_fault,
+	.on_access_upgrade = custom_on_access_upgrade,
+	.pick_victim = custom_pick_victim,
+	.on_evict = custom_on_evict,
+	.stats = custom_stats,
+	.destroy = custom_destroy,
+};
+
+/*
+Queued FIFO, the FIFO that adaptive runs.  Plain FIFO's rotation only
+holds while it picks every victim; under adaptive another policy may
+have chosen what was evicted, and the frame after the hand need not
+hold the oldest page.  So here every frame is on a queue in the order
+its page was loaded, and the victim is the head.  on_fault moves a
+frame to the tail.  A picked frame also moves to the tail at once: if
+the driver rejects it, it waits its turn again, and if not, the load
+that follows leaves it there.  When FIFO alone evicts, the queue is
+the same rotation, which is where "hand" points.  Plain FIFO stays
+lock-free; this one takes a lock on every fault.
+
+on_fault does not know which range a frame is in, so frames start on
+an unassigned queue in load order.  The first pick from a range gives
+it its own queue, taking its frames from the unassigned one in order.
+*/
+
+struct fifo_queue {
+	int head;
+	int tail;
+};
+
+struct fifo_state {
+	pthread_mutex_t lock;
+	int *next;
+	int *prev;
+	int *queue_of;
+	int *range_queue;
+	struct fifo_queue *queues;
+	int nqueues;
+};
+
+static int fifo_queued_init( int nframes, uint64_t seed, void **state )
+{
+	struct fifo_state *s = calloc(1,sizeof(*s));
+	int i;
+
+	if(!s) return -1;
+
+	s->next = malloc(sizeof(int)*nframes);
+	s->prev = malloc(sizeof(int)*nframes);
+	s->queue_of = malloc(sizeof(int)*nframes);
+	s->range_queue = calloc(nframes,sizeof(int));
+	s->queues = malloc(sizeof(struct fifo_queue)*(nframes+1));
+
+	if(!s->next || !s->prev || !s->queue_of || !s->range_queue || !s->queues) {
+		free(s->next);
+		free(s->prev);
+		free(s->queue_of);
+		free(s->range_queue);
+		free(s->queues);
+		free(s);
+		return -1;
+	}
+
+	/* Queue 0 holds frames not yet known to be in any range; -1 is off every queue. */
+
+	for(i=0;i<nframes;i++) s->queue_of[i] = -1;
+	s->queues[0].head = s->queues[0].tail = -1;
+	s->nqueues = 1;
+
+	pthread_mutex_init(&s->lock,0);
+
+	*state = s;
+	return 0;
+}
+
+static void fifo_unlink( struct fifo_state *s, int q, int frame )
+{
+	struct fifo_queue *queue = &s->queues[q];
+
+	if(s->prev[frame]>=0) s->next[s->prev[frame]] = s->next[frame];
+	else queue->head = s->next[frame];
+
+	if(s->next[frame]>=0) s->prev[s->next[frame]] = s->prev[frame];
+	else queue->tail = s->prev[frame];
+}
+
+static void fifo_append( struct fifo_state *s, int q, int frame )
+{
+	struct fifo_queue *queue = &s->queues[q];
+
+	s->next[frame] = -1;
+	s->prev[frame] = queue->tail;
+
+	if(queue->tail>=0) s->next[queue->tail] = frame;
+	else queue->head = frame;
+
+	queue->tail = frame;
+	s->queue_of[frame] = q;
+}
+
+/*
+Moves a frame to the tail of its queue.  A frame on none yet joins the
+queue of its range if the range has one, and the unassigned queue if
+not.
+*/
+
+static void fifo_to_tail( struct fifo_state *s, int frame )
+{
+	int q = s->queue_of[frame];
+
+	if(q>=0) fifo_unlink(s,q,frame);
+	else q = s->range_queue[frame];
+
+	fifo_append(s,q,frame);
+}
+
+/*
+Gives a range its own queue.  Its frames keep their load order, and
+the queue starts at the hand, which a warm start may have restored.
+*/
+
+static int fifo_assign( struct fifo_state *s, struct frame_range *range )
+{
+	int q = s->nqueues++;
+	int start = range->first + range->hand%range->count;
+	int frame, next;
+
+	s->queues[q].head = s->queues[q].tail = -1;
+
+	for(frame=s->queues[0].head;frame>=0;frame=next) {
+		next = s->next[frame];
+		if(frame>=range->first && frame<range->first+range->count) {
+			fifo_unlink(s,0,frame);
+			fifo_append(s,q,frame);
+		}
+	}
+
+	while(s->queue_of[start]==q && s->queues[q].head!=start) {
+		fifo_to_tail(s,s->queues[q].head);
+	}
+
+	for(frame=range->first;frame<range->first+range->count;frame++) {
+		s->range_queue[frame] = q;
+	}
+
+	return q;
+}
+
+static void fifo_queued_on_fault( void *state, int frame, long key )
+{
+	struct fifo_state *s = state;
+
+	pthread_mutex_lock(&s->lock);
+	fifo_to_tail(s,frame);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int fifo_queued_pick_victim( void *state, struct frame_range *range )
+{
+	struct fifo_state *s = state;
+	int q, frame;
+
+	pthread_mutex_lock(&s->lock);
+
+	q = s->range_queue[range->first];
+	if(!q) q = fifo_assign(s,range);
+
+	/* Nothing loaded yet is only possible while the driver is still filling the range. */
+
+	frame = s->queues[q].head;
+	if(frame<0) frame = range->first + range->hand%range->count;
+	else fifo_to_tail(s,frame);
+
+	range->hand = frame - range->first + 1;
+
+	pthread_mutex_unlock(&s->lock);
+
+	return frame;
+}
+
+static void fifo_queued_destroy( void *state )
+{
+	struct fifo_state *s = state;
+
+	pthread_mutex_destroy(&s->lock);
+	free(s->next);
+	free(s->prev);
+	free(s->queue_of);
+	free(s->range_queue);
+	free(s->queues);
+	free(s);
+}
+
+static const struct policy fifo_queued_policy = {
+	.name = "fifo",
+	.init = fifo_queued_init,
+	.on_fault = fifo_queued_on_fault,
+	.pick_victim = fifo_queued_pick_victim,
+	.destroy = fifo_queued_destroy,
+};
+
+/*
+Adaptive.  Runs fifo, rand and custom side by side and evicts with
+whichever currently looks best.  The real frames are managed by every
+candidate at once, so each keeps its bookkeeping up to date, but only
+the active one picks victims.
+
+The choice comes from shadow caches, set-dueling style.  A fixed
+sample of pages, chosen by hashing their keys, is replayed through a
+small simulated memory per candidate, holding the same fraction of
+the sampled pages as the real memory holds of all pages.  Every
+sampled fault and write upgrade is a reference to the shadows, and
+each shadow counts the references it would have missed.  At the end
+of every epoch each shadow folds its misses into a smoothed score,
+decaying the old one by ADAPTIVE_DECAY, and the shadow with the lowest
+score takes over.  It has to beat the active one by more than
+ADAPTIVE_HYSTERESIS and by at least ADAPTIVE_MIN_GAP misses: an epoch
+holds few references when there are few frames, and near ties there
+would otherwise make it flap and do worse than any single candidate.
+Switches are logged and printed with the stats.
+
+Reads of resident pages never fault, so the shadows only see the
+references that missed in the real memory or first wrote a page.
+*/
+
+#define ADAPTIVE_CANDIDATES 3
+#define ADAPTIVE_SHADOW_MAX 64
+#define ADAPTIVE_HYSTERESIS 0.10
+#define ADAPTIVE_DECAY      0.75
+#define ADAPTIVE_MIN_GAP    8.0
+#define ADAPTIVE_LOG_MAX    256
+
+struct shadow {
+	long keys[ADAPTIVE_SHADOW_MAX];
+	char marks[ADAPTIVE_SHADOW_MAX];
+	int used;
+	int hand;
+	long misses;
+	long total_misses;
+	double score;
+};
+
+struct adaptive_switch {
+	long reference;
+	int from;
+	int to;
+	double from_score;
+	double to_score;
+};
+
+struct adaptive_state {
+	const struct policy *candidates[ADAPTIVE_CANDIDATES];
+	void *states[ADAPTIVE_CANDIDATES];
+	int active;
+	long *frame_keys;
+	pthread_mutex_t lock;
+	int sample_rate;
+	int capacity;
+	int epoch;
+	int epoch_refs;
+	long references;
+	struct policy_random random;
+	struct shadow shadows[ADAPTIVE_CANDIDATES];
+	struct adaptive_switch log[ADAPTIVE_LOG_MAX];
+	int nswitches;
+};
+
+static int adaptive_init( int nframes, uint64_t seed, void **state )
+{
+	struct adaptive_state *s = calloc(1,sizeof(*s));
+	int i;
+
+	if(!s) return -1;
+
+	s->frame_keys = malloc(sizeof(long)*nframes);
+	if(!s->frame_keys) {
+		free(s);
+		return -1;
+	}
+	for(i=0;i<nframes;i++) s->frame_keys[i] = -1;
+
+	s->candidates[0] = &fifo_queued_policy;
+	s->candidates[1] = &rand_policy;
+	s->candidates[2] = &custom_policy;
+
+	for(i=0;i<ADAPTIVE_CANDIDATES;i++) {
+		if(s->candidates[i]->init && s->candidates[i]->init(nframes,seed+i+1,&s->states[i])<0) {
+			while(i-->0) {
+				if(s->candidates[i]->destroy) s->candidates[i]->destroy(s->states[i]);
+			}
+			free(s->frame_keys);
+			free(s);
+			return -1;
+		}
+	}
+
+	/* Sample one page in sample_rate, so that a shadow needs at most ADAPTIVE_SHADOW_MAX slots. */
+
+	s->sample_rate = (nframes+ADAPTIVE_SHADOW_MAX-1)/ADAPTIVE_SHADOW_MAX;
+	s->capacity = nframes/s->sample_rate;
+	s->epoch = s->capacity*4 < 64 ? 64 : s->capacity*4;
+	policy_random_seed(&s->random,seed);
+
+	pthread_mutex_init(&s->lock,0);
+
+	*state = s;
+	return 0;
+}
+
+static int adaptive_sampled( struct adaptive_state *s, long key )
+{
+	return ((unsigned long)key*0x9E3779B97F4A7C15UL>>40) % s->sample_rate == 0;
+}
+
+/* Replays one reference through the shadow of candidate "c". */
+
+static void shadow_reference( struct adaptive_state *s, int c, long key, int write )
+{
+	struct shadow *sh = &s->shadows[c];
+	int slot;
+
+	for(slot=0;slot<sh->used;slot++) {
+		if(sh->keys[slot]==key) {
+			if(write) sh->marks[slot] = 1;
+			return;
+		}
+	}
+
+	sh->misses++;
+	sh->total_misses++;
+
+	if(sh->used<s->capacity) {
+		slot = sh->used++;
+	} else if(c==0) {
+		slot = sh->hand;
+		sh->hand = (sh->hand+1)%s->capacity;
+	} else if(c==1) {
+		slot = policy_random_below(&s->random,s->capacity);
+	} else {
+		while(1) {
+			slot = policy_random_below(&s->random,s->capacity);
+			if(!sh->marks[slot]) break;
+			sh->marks[slot] = 0;
+		}
+	}
+
+	sh->keys[slot] = key;
+	sh->marks[slot] = write;
+}
+
+static void adaptive_reference( struct adaptive_state *s, long key, int write )
+{
+	int c, best = 0;
+
+	if(key<0 || !adaptive_sampled(s,key)) return;
+
+	pthread_mutex_lock(&s->lock);
+
+	s->references++;
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) shadow_reference(s,c,key,write);
+
+	if(++s->epoch_refs>=s->epoch) {
+		for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+			struct shadow *sh = &s->shadows[c];
+			sh->score = sh->score*ADAPTIVE_DECAY + sh->misses*(1-ADAPTIVE_DECAY);
+		}
+
+		for(c=1;c<ADAPTIVE_CANDIDATES;c++) {
+			if(s->shadows[c].score<s->shadows[best].score) best = c;
+		}
+
+		if(best!=s->active && s->shadows[best].score < s->shadows[s->active].score*(1-ADAPTIVE_HYSTERESIS) &&
+		   s->shadows[s->active].score-s->shadows[best].score >= ADAPTIVE_MIN_GAP) {
+			if(s->nswitches<ADAPTIVE_LOG_MAX) {
+				struct adaptive_switch *l = &s->log[s->nswitches];
+				l->reference = s->references;
+				l->from = s->active;
+				l->to = best;
+				l->from_score = s->shadows[s->active].score;
+				l->to_score = s->shadows[best].score;
+			}
+			s->nswitches++;
+			__atomic_store_n(&s->active,best,__ATOMIC_RELAXED);
+		}
+
+		for(c=0;c<ADAPTIVE_CANDIDATES;c++) s->shadows[c].misses = 0;
+		s->epoch_refs = 0;
+	}
+
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void adaptive_on_fault( void *state, int frame, long key )
+{
+	struct adaptive_state *s = state;
+	int c;
+
+	s->frame_keys[frame] = key;
+	adaptive_reference(s,key,0);
+
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+		if(s->candidates[c]->on_fault) s->candidates[c]->on_fault(s->states[c],frame,key);
+	}
+}
+
+static void adaptive_on_access_upgrade( void *state, int frame )
+{
+	struct adaptive_state *s = state;
+	int c;
+
+	adaptive_reference(s,s->frame_keys[frame],1);
+
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+		if(s->candidates[c]->on_access_upgrade) s->candidates[c]->on_access_upgrade(s->states[c],frame);
+	}
+}
+
+static int adaptive_pick_victim( void *state, struct frame_range *range )
+{
+	struct adaptive_state *s = state;
+	int c = __atomic_load_n(&s->active,__ATOMIC_RELAXED);
+
+	return s->candidates[c]->pick_victim(s->states[c],range);
+}
+
+static void adaptive_on_evict( void *state, int frame, long key )
+{
+	struct adaptive_state *s = state;
+	int c;
+
+	s->frame_keys[frame] = -1;
+
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+		if(s->candidates[c]->on_evict) s->candidates[c]->on_evict(s->states[c],frame,key);
+	}
+}
+
+static void adaptive_stats( void *state, FILE *out )
+{
+	struct adaptive_state *s = state;
+	int c, i;
+
+	fprintf(out,"Adaptive: active %s, %d switches, %ld sampled references (1 in %d pages, %d shadow frames)\n",
+		s->candidates[s->active]->name, s->nswitches, s->references, s->sample_rate, s->capacity);
+
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+		fprintf(out,"Shadow %s: Misses: %ld\n",s->candidates[c]->name,s->shadows[c].total_misses);
+	}
+
+	for(i=0;i<s->nswitches && i<ADAPTIVE_LOG_MAX;i++) {
+		struct adaptive_switch *l = &s->log[i];
+		fprintf(out,"Switch at sampled reference %ld: %s -> %s (smoothed misses %.1f vs %.1f)\n",
+			l->reference, s->candidates[l->from]->name, s->candidates[l->to]->name,
+			l->from_score, l->to_score);
+	}
+
+	if(s->nswitches>ADAPTIVE_LOG_MAX) {
+		fprintf(out,"(%d more switches not logged)\n",s->nswitches-ADAPTIVE_LOG_MAX);
+	}
+}
+
+static void adaptive_destroy( void *state )
+{
+	struct adaptive_state *s = state;
+	int c;
+
+	for(c=0;c<ADAPTIVE_CANDIDATES;c++) {
+		if(s->candidates[c]->destroy) s->candidates[c]->destroy(s->states[c]);
+	}
+
+	pthread_mutex_destroy(&s->lock);
+	free(s->frame_keys);
+	free(s);
+}
+
+const struct policy adaptive_policy = {
+	.name = "adaptive",
+	.init = adaptive_init,
+	.on_fault = adaptive_on_fault,
+	.on_access_upgrade = adaptive_on_access_upgrade,
+	.pick_victim = adaptive_pick_victim,
+	.on_evict = adaptive_on_evict,
+	.stats = adaptive_stats,
+	.destroy = adaptive_destroy,
+};
+
+static const struct policy *builtin_policies[] = {
+	&rand_policy,
+	&fifo_policy,
+	&custom_policy,
+	&adaptive_policy,
+};
+
+#define NBUILTINS (sizeof(builtin_policies)/sizeof(builtin_policies[0]))
+
+static const struct policy * policy_load( const char *path )
+{
+	void *handle = dlopen(path,RTLD_NOW|RTLD_LOCAL);
+	const struct policy *p;
+
+	if(!handle) {
+		fprintf(stderr,"couldn't load policy: %s\n",dlerror());
+		return 0;
+	}
+
+	p = dlsym(handle,"virtmem_policy");
+	if(!p) {
+		fprintf(stderr,"%s does not define virtmem_policy\n",path);
+		dlclose(handle);
+		return 0;
+	}
+
+	if(!p->name || !p->pick_victim) {
+		fprintf(stderr,"%s: virtmem_policy needs a name and pick_victim\n",path);
+		dlclose(handle);
+		return 0;
+	}
+
+	/* The handle stays open for the rest of the run. */
+
+	return p;
+}
+
+const struct policy * policy_find( const char *name )
+{
+	int i;
+
+	if(strchr(name,'/')) return policy_load(name);
+
+	for(i=0;i<NBUILTINS;i++) {
+		if(!strcmp(builtin_policies[i]->name,name)) return builtin_policies[i];
+	}
+
+	fprintf(stderr,"unknown policy: %s\n",name);
+	return 0;
+}
+
+void policy_print_names( FILE *out )
+{
+	int i;
+
+	for(i=0;i<NBUILTINS;i++) {
+		fprintf(out,"%s%s",i ? " " : "",builtin_policies[i]->name);
+	}
+}
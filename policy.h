@@ -0,0 +1,118 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+A set of frames that is filled and then recycled on its own.  With
+global replacement one range covers every frame; with local
+replacement each address space has its own slice.  "used" belongs to
+the fault driver; "hand" is free for the policy to use as a cursor.
+*/
+
+struct frame_range {
+	int first;
+	int count;
+	int used;
+	unsigned hand;
+};
+
+/*
+A replacement policy.  The fault driver owns the page tables and the
+disk, and tells the policy what happens to frames; the policy only
+chooses victims.  A page is named by a "key" that stays the same for
+as long as the run lasts, so a policy may remember pages that are no
+longer resident.
+
+init        Set up for a physical memory of "nframes" frames, storing
+            the policy's state, if any, in "state".  Any randomness
+            should come from a policy_random seeded with "seed", so
+            that a run is repeatable.  Returns 0 on success and -1 on
+            failure.
+on_fault    Page "key" has just been loaded into "frame".
+on_access_upgrade
+            The page in "frame" has just been written to for the
+            first time since it was loaded.
+pick_victim Return a frame of "range" whose page should be evicted.
+            The driver may reject it, if the frame is being refilled
+            or its page is busy, and ask again.
+on_evict    Page "key" has just been evicted from "frame".
+stats       Print anything worth reporting about the run, or null.
+destroy     Free the state made by init.
+
+Every callback except init, stats and destroy may be called by several
+faulting threads at once.  Only pick_victim is required; the state of
+a policy without init is null.
+
+A policy built as a shared object exports a "struct policy" named
+"virtmem_policy", and is selected by giving its path in place of a
+policy name.
+*/
+
+struct policy {
+	const char *name;
+	int (*init)( int nframes, uint64_t seed, void **state );
+	void (*on_fault)( void *state, int frame, long key );
+	void (*on_access_upgrade)( void *state, int frame );
+	int (*pick_victim)( void *state, struct frame_range *range );
+	void (*on_evict)( void *state, int frame, long key );
+	void (*stats)( void *state, FILE *out );
+	void (*destroy)( void *state );
+};
+
+/*
+A private random number generator for a policy, so that a policy's
+choices neither depend on nor disturb the rand() sequence the programs
+draw from.  It is SplitMix64: the state is a counter advanced by one
+atomic add per number, which makes it safe to share between faulting
+threads without a lock, and each number is a hash of the counter.
+*/
+
+struct policy_random {
+	uint64_t state;
+};
+
+static inline void policy_random_seed( struct policy_random *r, uint64_t seed )
+{
+	r->state = seed;
+}
+
+static inline uint64_t policy_random_next( struct policy_random *r )
+{
+	uint64_t z = __atomic_add_fetch(&r->state,0x9E3779B97F4A7C15ULL,__ATOMIC_RELAXED);
+	z = (z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+	z = (z^(z>>27))*0x94D049BB133111EBULL;
+	return z^(z>>31);
+}
+
+/* Return a random number from 0 to n-1. */
+
+static inline int policy_random_below( struct policy_random *r, int n )
+{
+	return (int)(((policy_random_next(r)>>32)*(uint64_t)n)>>32);
+}
+
+/*
+Find a built-in policy by name or, if "name" contains a '/', load
+the shared object it names.  Returns null and prints the reason on
+failure.
+*/
+
+const struct policy * policy_find( const char *name );
+
+/* Print the names of the built-in policies, separated by spaces. */
+
+void policy_print_names( FILE *out );
+
+/*
+The built-in policies themselves, for a build that fixes its policy
+at compile time and so calls the callbacks directly.
+*/
+
+extern const struct policy fifo_policy;
+extern const struct policy rand_policy;
+extern const struct policy custom_policy;
+extern const struct policy adaptive_policy;
+
+#endif
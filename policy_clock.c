@@ -0,0 +1,74 @@
+/*
+An example policy plugin: the clock algorithm.
+
+Every frame has a reference mark, set when a page is loaded into it
+and again when the page is first written.  The hand sweeps the range,
+clearing marks, and evicts the first frame it finds unmarked.  Pages
+that are only read after loading get no second reference, since reads
+of resident pages never fault.
+
+Build it with "make policy_clock.so" and run it with
+	./virtmem 100 10 ./policy_clock.so sort
+*/
+
+#include "policy.h"
+
+#include <stdlib.h>
+
+struct clock_state {
+	char *marks;
+};
+
+static int clock_init( int nframes, uint64_t seed, void **state )
+{
+	struct clock_state *s = malloc(sizeof(*s));
+	if(!s) return -1;
+
+	s->marks = calloc(nframes,1);
+	if(!s->marks) {
+		free(s);
+		return -1;
+	}
+
+	*state = s;
+	return 0;
+}
+
+static void clock_on_fault( void *state, int frame, long key )
+{
+	struct clock_state *s = state;
+	s->marks[frame] = 1;
+}
+
+static void clock_on_access_upgrade( void *state, int frame )
+{
+	struct clock_state *s = state;
+	s->marks[frame] = 1;
+}
+
+static int clock_pick_victim( void *state, struct frame_range *range )
+{
+	struct clock_state *s = state;
+
+	while(1) {
+		int frame = range->first + __atomic_fetch_add(&range->hand,1,__ATOMIC_RELAXED) % range->count;
+
+		if(!__atomic_exchange_n(&s->marks[frame],0,__ATOMIC_RELAXED)) return frame;
+	}
+}
+
+static void clock_destroy( void *state )
+{
+	struct clock_state *s = state;
+	free(s->marks);
+	free(s);
+}
+
+const struct policy virtmem_policy = {
+	.name = "clock",
+	.init = clock_init,
+	.on_fault = clock_on_fault,
+	.on_access_upgrade = clock_on_access_upgrade,
+	.pick_victim = clock_pick_victim,
+	.destroy = clock_destroy,
+};
@@ -7,6 +7,10 @@ Make all of your changes to main.c instead.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
 
 static int compare_bytes( const void *pa, const void *pb )
 {
@@ -23,22 +27,51 @@ static int compare_bytes( const void *pa, const void *pb )
 
 }
 
-void focus_program( char *data, int length )
+/*
+sort and focus draw the numbers rand() would give after srand(seed),
+but from a generator state of their own, so that programs running side
+by side on several threads never take numbers from each other.
+*/
+
+struct program_random {
+	struct random_data data;
+	char state[128];
+};
+
+static void program_srand( struct program_random *r, unsigned seed )
+{
+	memset(r,0,sizeof(*r));
+	initstate_r(seed,r->state,sizeof(r->state),&r->data);
+}
+
+static int program_rand( struct program_random *r )
+{
+	int32_t x;
+
+	random_r(&r->data,&x);
+	return x;
+}
+
+void focus_program( char *data, size_t length )
 {
+	struct program_random r;
 	int total=0;
-	int i,j;
+	size_t i;
+	int j;
 
-	srand(38290);
+	program_srand(&r,38290);
 
 	for(i=0;i<length;i++) {
 		data[i] = 0;
 	}
 
 	for(j=0;j<100;j++) {
-		int start = rand()%length;
+		size_t start = program_rand(&r);
 		int size = 25;
+		if(length>RAND_MAX) start = start*((size_t)RAND_MAX+1) + program_rand(&r);
+		start %= length;
 		for(i=0;i<100;i++) {
-			data[ (start+rand()%size)%length ] = rand();
+			data[ (start+program_rand(&r)%size)%length ] = program_rand(&r);
 		}
 	}
 
@@ -49,15 +82,16 @@ void focus_program( char *data, int length )
 	printf("focus result is %d\n",total);
 }
 
-void sort_program( char *data, int length )
+void sort_program( char *data, size_t length )
 {
+	struct program_random r;
 	int total = 0;
-	int i;
+	size_t i;
 
-	srand(4856);
+	program_srand(&r,4856);
 
 	for(i=0;i<length;i++) {
-		data[i] = rand();
+		data[i] = program_rand(&r);
 	}
 
 	qsort(data,length,1,compare_bytes);
@@ -70,9 +104,10 @@ void sort_program( char *data, int length )
 
 }
 
-void scan_program( char *cdata, int length )
+void scan_program( char *cdata, size_t length )
 {
-	unsigned i, j;
+	size_t i;
+	unsigned j;
 	unsigned char *data = (unsigned char*) cdata;
 	unsigned total = 0;
 
@@ -88,3 +123,417 @@ void scan_program( char *cdata, int length )
 
 	printf("scan result is %d\n",total);
 }
+
+/*
+A small xorshift generator for the extended workloads.  Each program
+seeds its own, so its access pattern depends only on the length.
+*/
+
+static uint64_t next_random( uint64_t *state )
+{
+	uint64_t x = *state;
+	x ^= x>>12;
+	x ^= x<<25;
+	x ^= x>>27;
+	*state = x;
+	return x*0x2545F4914F6CDD1DULL;
+}
+
+static double next_uniform( uint64_t *state )
+{
+	return (next_random(state)>>11)*(1.0/9007199254740992.0);
+}
+
+/*
+Zipfian accesses to 64-byte records, using the method of Gray et al.,
+"Quickly Generating Billion-Record Synthetic Databases".  Skew must lie
+between 0 and 1; the closer to 1, the more the accesses pile onto the
+most popular records, which sit at the start of the data.
+*/
+
+#define ZIPF_RECORD 64
+
+void zipf_program( char *data, size_t length, double skew )
+{
+	uint64_t state = 60133;
+	size_t n = length/ZIPF_RECORD;
+	size_t i, ops;
+	double zetan = 0, zeta2, alpha, eta;
+	unsigned total = 0;
+
+	if(n<2) n = 2;
+
+	for(i=1;i<=n;i++) zetan += 1.0/pow((double)i,skew);
+	zeta2 = 1.0 + 1.0/pow(2.0,skew);
+	alpha = 1.0/(1.0-skew);
+	eta = (1.0-pow(2.0/n,1.0-skew))/(1.0-zeta2/zetan);
+
+	ops = length/16;
+
+	for(i=0;i<ops;i++) {
+		double u = next_uniform(&state);
+		double uz = u*zetan;
+		size_t rank;
+
+		if(uz<1.0) {
+			rank = 0;
+		} else if(uz<zeta2) {
+			rank = 1;
+		} else {
+			rank = (size_t)(n*pow(eta*u-eta+1.0,alpha));
+			if(rank>=n) rank = n-1;
+		}
+
+		total += (unsigned char)++data[(rank*ZIPF_RECORD+(i%ZIPF_RECORD))%length];
+	}
+
+	printf("zipf result is %d\n",total);
+}
+
+/*
+Sixteen passes that each touch one byte every "stride" bytes, starting
+one cache line further along each time.
+*/
+
+void stride_program( char *data, size_t length, size_t stride )
+{
+	unsigned total = 0;
+	size_t i;
+	int pass;
+
+	for(pass=0;pass<16;pass++) {
+		for(i=(pass*64)%stride;i<length;i+=stride) {
+			total += (unsigned char)data[i];
+			data[i] = pass;
+		}
+	}
+
+	printf("stride result is %d\n",total);
+}
+
+/*
+C = A*B on three square matrices of unsigned ints laid out one after
+another.  The naive version walks B down its columns in the inner loop;
+the blocked version works on tile x tile squares that fit in far fewer
+pages.  Both compute the same C, so they report the same result.
+*/
+
+static size_t matmul_setup( char *data, size_t length, unsigned **a, unsigned **b, unsigned **c )
+{
+	size_t n = 0, i, j;
+
+	while((n+1)*(n+1)*3*sizeof(unsigned)<=length) n++;
+
+	*a = (unsigned*) data;
+	*b = *a+n*n;
+	*c = *b+n*n;
+
+	for(i=0;i<n;i++) {
+		for(j=0;j<n;j++) {
+			(*a)[i*n+j] = i+2*j;
+			(*b)[i*n+j] = 3*i+j+1;
+			(*c)[i*n+j] = 0;
+		}
+	}
+
+	return n;
+}
+
+static unsigned matmul_total( unsigned *c, size_t n )
+{
+	unsigned total = 0;
+	size_t i;
+
+	for(i=0;i<n*n;i++) total += c[i];
+
+	return total;
+}
+
+void matmul_program( char *data, size_t length )
+{
+	unsigned *a, *b, *c;
+	size_t n = matmul_setup(data,length,&a,&b,&c);
+	size_t i, j, k;
+
+	for(i=0;i<n;i++) {
+		for(j=0;j<n;j++) {
+			unsigned sum = 0;
+			for(k=0;k<n;k++) {
+				sum += a[i*n+k]*b[k*n+j];
+			}
+			c[i*n+j] = sum;
+		}
+	}
+
+	printf("matmul result is %d\n",matmul_total(c,n));
+}
+
+void matmul_blocked_program( char *data, size_t length, size_t tile )
+{
+	unsigned *a, *b, *c;
+	size_t n = matmul_setup(data,length,&a,&b,&c);
+	size_t ii, jj, kk, i, j, k;
+
+	for(ii=0;ii<n;ii+=tile) {
+		for(kk=0;kk<n;kk+=tile) {
+			for(jj=0;jj<n;jj+=tile) {
+				size_t iend = ii+tile<n ? ii+tile : n;
+				size_t kend = kk+tile<n ? kk+tile : n;
+				size_t jend = jj+tile<n ? jj+tile : n;
+				for(i=ii;i<iend;i++) {
+					for(k=kk;k<kend;k++) {
+						unsigned aik = a[i*n+k];
+						for(j=jj;j<jend;j++) {
+							c[i*n+j] += aik*b[k*n+j];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	printf("matmul-blocked result is %d\n",matmul_total(c,n));
+}
+
+/*
+Builds one random cycle through every slot with Sattolo's algorithm,
+then follows it all the way round, so each step lands on a page that
+has nothing to do with the last one.
+*/
+
+void chase_program( char *data, size_t length )
+{
+	uint64_t state = 7411;
+	size_t *next = (size_t*) data;
+	size_t n = length/sizeof(size_t);
+	size_t i, p = 0;
+	unsigned total = 0;
+
+	for(i=0;i<n;i++) next[i] = i;
+
+	for(i=n-1;i>0;i--) {
+		size_t j = next_random(&state)%i;
+		size_t t = next[i];
+		next[i] = next[j];
+		next[j] = t;
+	}
+
+	for(i=0;i<n;i++) {
+		p = next[p];
+		total += p;
+	}
+
+	printf("chase result is %d\n",total);
+}
+
+/*
+An open-addressed hash table of 64-bit keys with linear probing.  It
+is filled to half its slots, then takes a mix of nine lookups of keys
+already present to every insert of a new key, up to three quarters
+full.  Key 0 marks an empty slot.
+*/
+
+static uint64_t hash_key( uint64_t i )
+{
+	i += 0x9E3779B97F4A7C15ULL;
+	i = (i^(i>>30))*0xBF58476D1CE4E5B9ULL;
+	i = (i^(i>>27))*0x94D049BB133111EBULL;
+	i ^= i>>31;
+	return i ? i : 1;
+}
+
+static size_t hash_find( uint64_t *table, size_t n, uint64_t key )
+{
+	size_t slot = key%n;
+
+	while(table[slot] && table[slot]!=key) {
+		slot = slot+1<n ? slot+1 : 0;
+	}
+
+	return slot;
+}
+
+void hash_program( char *data, size_t length )
+{
+	uint64_t state = 91127;
+	uint64_t *table = (uint64_t*) data;
+	size_t n = length/sizeof(uint64_t);
+	size_t i, keys = 0, hits = 0;
+
+	for(i=0;i<n;i++) table[i] = 0;
+
+	while(keys<n/2) {
+		uint64_t key = hash_key(keys++);
+		table[hash_find(table,n,key)] = key;
+	}
+
+	for(i=0;i<n;i++) {
+		if(next_random(&state)%10 || keys>=n*3/4) {
+			uint64_t key = hash_key(next_random(&state)%keys);
+			if(table[hash_find(table,n,key)]==key) hits++;
+		} else {
+			uint64_t key = hash_key(keys++);
+			table[hash_find(table,n,key)] = key;
+		}
+	}
+
+	printf("hash result is %d\n",(int)hits);
+}
+
+/*
+Reads and rewrites one byte of every cache line, front to back, over
+and over.  With a few more pages than frames, FIFO evicts each page
+just before it is needed again.
+*/
+
+void loop_program( char *data, size_t length, int passes )
+{
+	unsigned total = 0;
+	size_t i;
+	int pass;
+
+	for(pass=0;pass<passes;pass++) {
+		for(i=0;i<length;i+=64) {
+			total += (unsigned char)data[i];
+			data[i] = pass+i;
+		}
+	}
+
+	printf("loop result is %d\n",total);
+}
+
+/*
+The multi-threaded programs give each thread one contiguous slice of
+the data, so that the threads fault on different pages at the same
+time, and meet at a barrier between phases.
+*/
+
+struct slice {
+	int id;
+	int nthreads;
+	char *data;
+	size_t length;
+	size_t start;
+	size_t end;
+	unsigned total;
+	size_t counts[256];
+	size_t *all_counts;
+	pthread_barrier_t *barrier;
+};
+
+typedef void * (*slice_func_t)( void *arg );
+
+static unsigned run_slices( char *data, size_t length, int nthreads, slice_func_t func )
+{
+	pthread_t *threads = malloc(sizeof(pthread_t)*nthreads);
+	struct slice *slices = calloc(nthreads,sizeof(struct slice));
+	size_t all_counts[256];
+	pthread_barrier_t barrier;
+	unsigned total = 0;
+	int i;
+
+	memset(all_counts,0,sizeof(all_counts));
+	pthread_barrier_init(&barrier,0,nthreads);
+
+	for(i=0;i<nthreads;i++) {
+		slices[i].id = i;
+		slices[i].nthreads = nthreads;
+		slices[i].data = data;
+		slices[i].length = length;
+		slices[i].start = length*i/nthreads;
+		slices[i].end = length*(i+1)/nthreads;
+		slices[i].all_counts = all_counts;
+		slices[i].barrier = &barrier;
+		pthread_create(&threads[i],0,func,&slices[i]);
+	}
+
+	for(i=0;i<nthreads;i++) {
+		pthread_join(threads[i],0);
+		total += slices[i].total;
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(slices);
+	free(threads);
+
+	return total;
+}
+
+static void * scan_slice( void *arg )
+{
+	struct slice *s = arg;
+	unsigned char *data = (unsigned char*) s->data;
+	size_t i;
+	unsigned j;
+
+	for(i=s->start;i<s->end;i++) {
+		data[i] = i%256;
+	}
+
+	for(j=0;j<10;j++) {
+		for(i=s->start;i<s->end;i++) {
+			s->total += data[i];
+		}
+	}
+
+	return 0;
+}
+
+void scan_program_mt( char *cdata, size_t length, int nthreads )
+{
+	unsigned total = run_slices(cdata,length,nthreads,scan_slice);
+
+	printf("scan-mt result is %d\n",total);
+}
+
+/*
+Each thread fills and sorts its own slice.  Bytes only take 256
+values, so the sorted slices are merged by counting: once every
+thread has published how often each value occurs, each thread writes
+its own part of the final sorted order.
+*/
+
+static void * sort_slice( void *arg )
+{
+	struct slice *s = arg;
+	unsigned seed = 4856+s->id;
+	size_t i, pos;
+	int v;
+
+	for(i=s->start;i<s->end;i++) {
+		s->data[i] = rand_r(&seed);
+	}
+
+	qsort(s->data+s->start,s->end-s->start,1,compare_bytes);
+
+	for(i=s->start;i<s->end;i++) {
+		s->counts[s->data[i]+128]++;
+	}
+
+	for(v=0;v<256;v++) {
+		__atomic_fetch_add(&s->all_counts[v],s->counts[v],__ATOMIC_RELAXED);
+	}
+
+	pthread_barrier_wait(s->barrier);
+
+	for(v=0,pos=0;v<256 && pos<s->end;v++) {
+		size_t next = pos+s->all_counts[v];
+		size_t lo = pos>s->start ? pos : s->start;
+		size_t hi = next<s->end ? next : s->end;
+		if(lo<hi) memset(s->data+lo,v-128,hi-lo);
+		pos = next;
+	}
+
+	for(i=s->start;i<s->end;i++) {
+		s->total += s->data[i];
+	}
+
+	return 0;
+}
+
+void sort_program_mt( char *data, size_t length, int nthreads )
+{
+	int total = run_slices(data,length,nthreads,sort_slice);
+
+	printf("sort-mt result is %d\n",total);
+}
@@ -6,8 +6,29 @@ Make all of your changes to main.c instead.
 #ifndef PROGRAM_H
 #define PROGRAM_H
 
-void scan_program( char *data, int length );
-void sort_program( char *data, int length );
-void focus_program( char *data, int length );
+#include <stddef.h>
+
+/*
+Every program draws its random numbers from a private generator with a
+fixed seed, so it touches the same pages in the same order on every
+run, whatever the policy or the programs running beside it do.
+*/
+
+void scan_program( char *data, size_t length );
+void sort_program( char *data, size_t length );
+void focus_program( char *data, size_t length );
+
+void zipf_program( char *data, size_t length, double skew );
+void stride_program( char *data, size_t length, size_t stride );
+void matmul_program( char *data, size_t length );
+void matmul_blocked_program( char *data, size_t length, size_t tile );
+void chase_program( char *data, size_t length );
+void hash_program( char *data, size_t length );
+void loop_program( char *data, size_t length, int passes );
+
+/* The same work as scan_program and sort_program, split over "nthreads" threads. */
+
+void scan_program_mt( char *data, size_t length, int nthreads );
+void sort_program_mt( char *data, size_t length, int nthreads );
 
 #endif
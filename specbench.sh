@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Compares the CPU each fault costs in the generic virtmem, the
+# optimized virtmem-release and the policy-specialized virtmem-<policy>
+# builds.  Every run is repeated REPEATS times and the median wall time
+# per fault is reported, with the saving against the generic binary.
+# PAGES, FRAMES, POLICIES, WORKLOADS and REPEATS may be set in the
+# environment to change the sweep.
+
+pages=${PAGES:-1000}
+frames=${FRAMES:-250}
+policies=${POLICIES:-"fifo rand custom adaptive"}
+workloads=${WORKLOADS:-"scan loop zipf"}
+repeats=${REPEATS:-5}
+
+dir=$(cd "$(dirname "$0")" && pwd)
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+cd "$scratch"
+
+# Prints the faults of one run and its median wall time per fault in ns.
+
+measure()
+{
+    for i in $(seq $repeats)
+    do
+        "$@" | awk '/^Frames:/ { gsub(/[A-Za-z]+: /, ""); split($0, f, ", "); print f[3], f[7] }'
+    done | sort -k2 -g | awk -v n=$repeats 'NR == int((n + 1) / 2) { printf "%d %.1f\n", $1, $2 * 1e9 / $1 }'
+}
+
+echo "Workload,Policy,Build,Faults,NsPerFault,SavedPct"
+
+for workload in $workloads
+do
+    for policy in $policies
+    do
+        read faults generic < <(measure "$dir/virtmem" $pages $frames $policy $workload)
+        echo "$workload,$policy,generic,$faults,$generic,0.0"
+
+        for build in release $policy
+        do
+            read faults ns < <(measure "$dir/virtmem-$build" $pages $frames $policy $workload)
+            awk -v w=$workload -v p=$policy -v b=$build -v f=$faults -v ns=$ns -v g=$generic \
+                'BEGIN { printf "%s,%s,%s,%d,%.1f,%.1f\n", w, p, (b == "release" ? b : "specialized"), f, ns, 100 * (g - ns) / g }'
+        done
+    done
+done
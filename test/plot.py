@@ -15,7 +15,7 @@ with open(filename, newline='') as csvfile:
         columns[h.strip()] = []
     for row in reader:
         for h, v in zip(headers, row):
-            columns[h.strip()].append(int(v))
+            columns[h.strip()].append(float(v))
 
 fig, ax = plt.subplots()
 